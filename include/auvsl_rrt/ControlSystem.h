@@ -33,6 +33,9 @@ public:
   ~SimpleControlSystem();
   int initialize() override;
   int computeVelocityCommand(std::vector<Eigen::Vector2f> waypoints, geometry_msgs::Pose pose, float &v_forward, float &v_angular) override;
+  
+  //Same law on plain numbers, for rollouts that call it every step. quat is qx qy qz qw.
+  static void computeCommand(float x, float y, const float *quat, float target_x, float target_y, float &v_forward, float &v_angular);
 };
   
 
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+
+
+/*
+ * Streaming reader for gridded elevation models.
+ * Supports ESRI ASCII grids (.asc) and ESRI binary float grids (.flt + .hdr).
+ * Rows are read one at a time from north to south so a whole raster never
+ * has to be resident in memory.
+ */
+
+class DemReader{
+public:
+  DemReader();
+  ~DemReader();
+
+  int open(const char *dem_fn);
+  void close();
+  int readRow(float *row); //row must hold ncols_ floats. Returns 0 on failure or end of file.
+
+  unsigned ncols_;
+  unsigned nrows_;
+  float xllcorner_; //lower left corner of the lower left cell
+  float yllcorner_;
+  float cellsize_;
+  float nodata_;
+
+  int is_binary_;
+  int is_msb_first_;
+  unsigned rows_read_;
+
+private:
+  int readHeader(std::ifstream &header_file);
+
+  std::ifstream data_file_;
+};
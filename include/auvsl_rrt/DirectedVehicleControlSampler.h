@@ -40,6 +40,10 @@
 #include "ompl/control/ControlSampler.h"
 #include "ompl/util/RandomNumbers.h"
 
+#include "JackalStatePropagator.h"
+
+#include <vector>
+
 class DirectedVehicleControlSampler : public ompl::control::DirectedControlSampler {
  public:
       
@@ -62,10 +66,31 @@ class DirectedVehicleControlSampler : public ompl::control::DirectedControlSampl
   
  protected:
   virtual unsigned int getBestControl(ompl::control::Control *control, const ompl::base::State *source, ompl::base::State *dest, const ompl::control::Control *previous);
+  
+  unsigned int propagateWhileValid(const ompl::base::State *source, const ompl::control::Control *control, unsigned int steps, ompl::base::State *result, ompl::base::State *scratch) const;
+  void propagateCandidates(const JackalStatePropagator *propagator, const ompl::base::State *source, unsigned int k);
+  void allocCandidates();
+  void freeCandidates();
 
   unsigned int numControlSamples_;
   ompl::RNG rng_;
   ompl::control::ControlSamplerPtr cs_;
+  
+  //Candidates are propagated in parallel on the JackalStatePropagator's pool, serially with
+  //any other propagator. Scratch is kept between calls, one set per candidate.
+  std::vector<ompl::control::Control*> candidate_controls_;
+  std::vector<ompl::base::State*> candidate_states_;
+  std::vector<ompl::base::State*> scratch_states_;
+  std::vector<unsigned int> candidate_steps_;
+  std::vector<double> candidate_distances_;
+  std::vector<unsigned int> target_steps_;
+  std::vector<unsigned int> batch_index_;
+  std::vector<const ompl::base::State*> batch_states_;
+  std::vector<const ompl::control::Control*> batch_controls_;
+  std::vector<double> batch_durations_;
+  std::vector<ompl::base::State*> batch_results_;
+  std::vector<unsigned> batch_steps_;
+  std::vector<int> batch_valid_;
 };
 
   
@@ -31,6 +31,21 @@ public:
   static float get_p_gain();
   static float get_goal_tolerance();
   static float get_max_gp_runtime();
+  static int get_num_threads();
+
+  static bool get_adaptive_integration();
+  static float get_integration_tolerance();
+  static float get_integration_rel_tolerance();
+  static int get_max_step_scale();
+
+  static bool get_two_fidelity_planning();
+  static float get_kinematic_turn_efficiency();
+  static float get_kinematic_slip();
+  static float get_verify_tolerance();
+  static float get_track_min_speed();
+  static int get_validity_check_interval();
+
+  static bool get_use_model_state_space();
 
 private:
   static float fuzzy_constant_speed;
@@ -58,4 +73,19 @@ private:
 
   static float goal_tolerance;
   static float max_gp_runtime;
+  static int num_threads;
+
+  static bool adaptive_integration;
+  static float integration_tolerance;
+  static float integration_rel_tolerance;
+  static int max_step_scale;
+
+  static bool two_fidelity_planning;
+  static float kinematic_turn_efficiency;
+  static float kinematic_slip;
+  static float verify_tolerance;
+  static float track_min_speed;
+  static int validity_check_interval;
+
+  static bool use_model_state_space;
 };
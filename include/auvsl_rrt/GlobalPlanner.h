@@ -2,9 +2,14 @@
 
 
 #include "VehicleStateSpace.h"
+#include "VehicleModelStateSpace.h"
 #include "VehicleRRT.h"
 #include "TerrainMap.h"
 #include "OctoTerrainMap.h"
+#include "TerrainCatalog.h"
+#include "SharedTerrainMap.h"
+#include "LocalTerrainMap.h"
+#include "MotionPrimitiveLibrary.h"
 
 #include <ompl/base/SpaceInformation.h>
 #include <ompl/control/SimpleSetup.h>
@@ -35,8 +40,9 @@ public:
   ~GlobalPlanner();
 
   static bool isStateValid(const ompl::base::State *state);
+  static bool isModelStateValid(const float *model_state);
   int plan(std::vector<RigidBodyDynamics::Math::Vector2d> &waypoints, float *vehicle_start_state, RigidBodyDynamics::Math::Vector2d goal_pos, float goal_tol);
-  void getWaypoints(std::vector<ompl::control::Control*> &controls, std::vector<double> &durations, std::vector<ompl::base::State*> states, std::vector<geometry_msgs::PoseStamped> &waypoints, unsigned &num_waypoints);
+  void statesToWaypoints(const std::vector<ompl::base::State*> &states, std::vector<geometry_msgs::PoseStamped> &waypoints);
   
   void initialize(std::string name, costmap_2d::Costmap2DROS* costmap_ros) override;
   bool makePlan(const geometry_msgs::PoseStamped& start,
@@ -46,12 +52,22 @@ public:
     
 private:
   static const TerrainMap *global_map_; //don't want to make changes to the terrain map in the global planner.
+  TerrainCatalog *catalog_; //NULL unless /TerrainCatalog/catalog_filename is set. Owns global_map_ when it is used.
+  SharedTerrainMap *shared_map_; //NULL unless /TerrainServer/use_shared_map is set.
+  LocalTerrainMap *local_map_; //NULL unless /LocalMap/use_local_map is set.
+  MotionPrimitiveLibrary *primitives_; //NULL unless /MotionPrimitives/table_filenames is set.
+  const TerrainMap *cache_map_; //map and revision the propagation cache was filled on
+  unsigned long cache_revision_;
+  
+  void setMapBounds();
+  static const ompl::base::RealVectorBounds& getSpaceBounds(); //x y bounds live at different indices in each space
 
   ompl::control::SpaceInformationPtr si_;
   ompl::base::ProblemDefinitionPtr pdef_;
   ompl::base::PlannerPtr planner_;
   static ompl::base::StateSpacePtr space_ptr_; //needed in isStateValid
   ompl::control::StatePropagatorPtr dynamic_model_ptr_;
+  ompl::control::StatePropagatorPtr kinematic_model_ptr_; //grows the tree when two_fidelity_planning is set
   //float G_TOLERANCE_;
 };
 
@@ -5,6 +5,26 @@
 #include <ompl/base/spaces/RealVectorStateSpace.h>
 #include <rbdl/rbdl.h>
 #include <auvsl_dynamics/HybridDynamics.h>
+#include "ThreadPool.h"
+#include "MotionPrimitiveLibrary.h"
+#include "PropagationCache.h"
+#include "PropagationProfiler.h"
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+//Cheap check on a 21 float model state, run inside the integration loop.
+typedef std::function<bool(const float*)> ModelValidityFn;
+
+//Trajectory from JackalStatePropagator::rollout, flat and reused between calls.
+struct Rollout{
+  std::vector<float> states; //21 model floats per step, the state at the end of the step
+  std::vector<double> controls; //Wz Vf per step
+  unsigned size;
+  
+  Rollout() : size(0){}
+};
 
 class JackalStatePropagator : public ompl::control::StatePropagator{
  public:
@@ -12,16 +32,89 @@ class JackalStatePropagator : public ompl::control::StatePropagator{
   ~JackalStatePropagator();
 
   virtual void propagate(const ompl::base::State* state, const ompl::control::Control* control, double duration, ompl::base::State *result) const override;
+  
+  //Independent rollouts spread over the worker pool. steps[i] is how many solver
+  //steps item i took and valid[i] is whether results[i] passed the validity checker.
+  void propagateBatch(const std::vector<const ompl::base::State*> &states, const std::vector<const ompl::control::Control*> &controls,
+                      const std::vector<double> &durations, const std::vector<ompl::base::State*> &results,
+                      std::vector<unsigned> &steps, std::vector<int> &valid) const;
+  //Like propagate, but runs the model validity checker every check_interval solver steps and
+  //stops at the first failure. result is then the last state that passed and valid_duration
+  //how far it got. Returns true if the whole duration was valid. Without a checker this is propagate.
+  //Primitives and the cache are tried first and a hit is only checked at its end, like propagate.
+  bool propagateUntilInvalid(const ompl::base::State *state, const ompl::control::Control *control, double duration,
+                             ompl::base::State *result, double &valid_duration) const;
+  //SimpleControlSystem chasing (goal_x, goal_y) and the dynamics in one loop on this thread's
+  //solver, for up to max_steps steps of step_duration. No OMPL states or controls are made, call
+  //getRolloutStep for the steps that are kept. Returns the number of valid steps.
+  unsigned rollout(const ompl::base::State *start, double goal_x, double goal_y, unsigned max_steps, double step_duration, Rollout &rollout) const;
+  void getRolloutStep(const Rollout &rollout, unsigned i, ompl::base::State *state, ompl::control::Control *control) const;
+  //Primitives and the cache answer single steps in the planner layout, so they need the step by step
+  //path, where propagateUntilInvalid consults them.
+  bool canRollout() const{
+    return !primitives_ && !cache_;
+  }
+  
+  void setModelValidityChecker(const ModelValidityFn &checker, unsigned check_interval){
+    model_validity_checker_ = checker;
+    check_interval_ = std::max(1u, check_interval);
+  }
+  
   void getWaypoints(std::vector<ompl::control::Control*> &controls, std::vector<double> &durations, std::vector<ompl::base::State*> states, std::vector<RigidBodyDynamics::Math::Vector2d> &waypoints, unsigned &num_waypoints);
   virtual bool canPropagateBackward() const override;
   virtual bool steer(const ompl::base::State* from, const ompl::base::State* to, ompl::control::Control* result, double &duration) const override;
   virtual bool canSteer() const override;
 
 
+  //Steps the library can answer skip the solver. NULL turns it off. Not owned.
+  void setMotionPrimitives(const MotionPrimitiveLibrary *primitives){
+    primitives_ = primitives;
+  }
+
+  //NULL unless /PropagationCache/capacity is set.
+  PropagationCache* getCache() const{
+    return cache_;
+  }
+
   static void convert_to_model_space(const double *planner_state, float *model_state);
   static void convert_to_planner_space(double *planner_state, const float *model_state);
+  
+  //Solvers are built once per thread and reused. After warm up, allocs should equal
+  //the number of planning threads no matter how many calls. Inits grow with the
+  //propagations that reach the solver, one each plus one per alloc.
+  static unsigned long getNumSolverAllocs(){ return PropagationProfiler::snapshot().solver_allocs; }
+  static unsigned long getNumSolverInits(){ return PropagationProfiler::snapshot().solver_inits; }
+  static unsigned long getNumPropagateCalls(){ return PropagationProfiler::snapshot().calls; }
+  static unsigned long getNumSolverSteps(){ return PropagationProfiler::snapshot().solver_steps; }
+  static unsigned long getNumRejectedSteps(){ return PropagationProfiler::snapshot().rejected_steps; }
+  static unsigned long getNumPrimitiveHits(){ return PropagationProfiler::snapshot().primitive_hits; }
+  static unsigned long getNumEarlyExits(){ return PropagationProfiler::snapshot().early_exits; }
 
  private:
+  //Step doubling state, carried across the chunks of one trajectory so the step size
+  //isn't relearned at every validity check.
+  struct AdaptiveStep{
+    int scale; //h in base steps, 1 is plain base steps
+    int plain_left; //base steps before doubling is tried again
+    int backoff;
+    
+    AdaptiveStep() : scale(2), plain_left(0), backoff(2){}
+  };
+  
+  static HybridDynamics& getThreadSolver();
+  static unsigned integrateAdaptive(HybridDynamics &solver, float vl, float vr, int &remaining, int min_steps, AdaptiveStep &step);
+  static void controlToWheels(const double *control_vector, float &vl, float &vr);
+  void readModelState(const ompl::base::State *state, float *model_state) const;
+  void writeModelState(const float *model_state, ompl::base::State *state) const;
+  unsigned propagateSteps(const ompl::base::State *state, const ompl::control::Control *control, double duration, ompl::base::State *result) const;
+  
+  ThreadPool *pool_;
+  const MotionPrimitiveLibrary *primitives_;
+  bool model_space_; //states are VehicleModelStateSpace, no layout conversion needed
+  PropagationCache *cache_;
+  ModelValidityFn model_validity_checker_;
+  unsigned check_interval_;
+  
   //ControlSystem *control_system_;
   //JackalDynamicSolver solver;
 };
@@ -0,0 +1,29 @@
+#include <ompl/control/StatePropagator.h>
+#include <ompl/control/Control.h>
+#include <ompl/control/SpaceInformation.h>
+#include <ompl/control/spaces/RealVectorControlSpace.h>
+#include <ompl/base/spaces/RealVectorStateSpace.h>
+
+#pragma once
+
+/*
+ * Cheap stand in for JackalStatePropagator when growing the tree.
+ * Skid steer unicycle, integrated in closed form. Commanded turn rate is
+ * scaled by kinematic_turn_efficiency and forward speed by 1 - kinematic_slip
+ * to roughly account for the tires scrubbing. Roll, pitch and z are left alone.
+ * Paths planned with this have to be checked with the full dynamics.
+ */
+
+class KinematicStatePropagator : public ompl::control::StatePropagator{
+ public:
+  KinematicStatePropagator(ompl::control::SpaceInformationPtr si);
+  ~KinematicStatePropagator();
+
+  virtual void propagate(const ompl::base::State* state, const ompl::control::Control* control, double duration, ompl::base::State *result) const override;
+  virtual bool canPropagateBackward() const override;
+  virtual bool canSteer() const override;
+
+ private:
+  float turn_efficiency_;
+  float slip_;
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "TerrainMap.h"
+
+#include <ros/ros.h>
+#include <ros/callback_queue.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <tf2_ros/buffer.h>
+#include <tf2_ros/transform_listener.h>
+
+#include <vector>
+
+
+/*
+ * Fixed size robot-centric terrain map fed from PointCloud2 messages.
+ * The grids are ring buffers. Moving the center only clears the rows and
+ * columns that scroll out of the window, nothing gets copied.
+ * Each scan is transformed into map_frame with tf2 and recenters the window
+ * on base_frame at the scan's stamp.
+ * Scans wait on the map's own callback queue until update() is called, so
+ * the map never changes while a plan is using it.
+ */
+
+class LocalTerrainMap : public TerrainMap{
+public:
+  LocalTerrainMap();
+  ~LocalTerrainMap();
+
+  void update(); //processes the scans that arrived since the last call
+  void setCenter(float x, float y);
+  void insertCloud(const sensor_msgs::PointCloud2 &cloud); //cloud is in map_frame
+  void cloudCallback(const sensor_msgs::PointCloud2ConstPtr& msg);
+
+  BekkerData getSoilDataAt(float x, float y) const override;
+  float getAltitude(float x, float y, float z_guess) const override;
+  int isStateValid(float x, float y) const override;
+  std::vector<Rectangle*> getObstacles() const override;
+  void getBounds(float &max_x, float &min_x, float &max_y, float &min_y) const override;
+  unsigned long getRevision() const override{ return revision_; }
+
+  unsigned size_;   //cells per side
+  float map_res_;
+  int origin_col_;  //world cell index of the lower left corner of the window
+  int origin_row_;
+
+private:
+  inline unsigned wrap(int idx) const{
+    int temp = idx % (int)size_;
+    return (temp < 0) ? (temp + size_) : temp;
+  }
+  inline unsigned cellIndex(int world_row, int world_col) const{
+    return (wrap(world_row)*size_) + wrap(world_col);
+  }
+  int worldToCell(float x, float y, int &world_row, int &world_col) const;
+  void clearCell(unsigned idx);
+
+  float obstacle_height_; //height spread within a cell that makes it an obstacle
+  float max_height_;      //points this far above the robot are ignored, same as the global pass through filter
+  float robot_z_;
+
+  float *ground_z_;  //lowest point seen in the cell
+  float *max_z_;     //highest point seen in the cell
+  unsigned *scan_id_; //which scan last touched the cell, so the newest scan wins
+  unsigned current_scan_;
+  unsigned long revision_; //bumped by every scan and every move of the window
+
+  std::string map_frame_;
+  std::string base_frame_;
+  
+  ros::CallbackQueue queue_;
+  ros::NodeHandle *private_nh_;
+  ros::Subscriber cloud_sub_;
+  tf2_ros::Buffer *tf_buffer_;
+  tf2_ros::TransformListener *tf_listener_;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+
+
+/*
+ * Read only, memory mapped view of a binary PCD file.
+ * Points are accessed in place through the file's own stride, so a site
+ * cloud can be filtered without first copying it into a pcl::PointCloud.
+ * Only DATA binary is supported. ascii and binary_compressed files fail to open.
+ */
+
+class MappedPcdCloud{
+public:
+  MappedPcdCloud();
+  ~MappedPcdCloud();
+
+  int open(const char *pcd_fn);
+  void close();
+
+  size_t size() const{
+    return num_points_;
+  }
+
+  inline float x(size_t i) const{
+    return readFloat(i, x_offset_);
+  }
+  inline float y(size_t i) const{
+    return readFloat(i, y_offset_);
+  }
+  inline float z(size_t i) const{
+    return readFloat(i, z_offset_);
+  }
+
+private:
+  inline float readFloat(size_t i, size_t offset) const{
+    float temp;
+    memcpy(&temp, data_ + (i*stride_) + offset, sizeof(float)); //fields aren't guaranteed to be aligned
+    return temp;
+  }
+
+  int fd_;
+  unsigned char *map_;
+  size_t map_size_;
+  const unsigned char *data_;
+
+  size_t num_points_;
+  size_t stride_;
+  size_t x_offset_;
+  size_t y_offset_;
+  size_t z_offset_;
+};
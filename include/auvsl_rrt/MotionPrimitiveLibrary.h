@@ -0,0 +1,82 @@
+#pragma once
+
+#include "TerrainMap.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/*
+ * Table of one propagation step of JackalStatePropagator on flat ground, swept
+ * offline over commanded Wz, commanded Vf, initial forward speed and initial yaw
+ * rate. One table per soil. On flat, uniform terrain the result of a step only
+ * depends on the pose through a rigid SE(2) transform, so a table lookup
+ * moved to the start pose can stand in for the simulation.
+ * apply() returns 0 whenever that doesn't hold (slope, soil, tilted or sliding
+ * start, key off the grid) and the caller should simulate instead.
+ *
+ * File layout: PrimitiveTableHeader, then num_wz*num_vf*num_v0*num_w0 entries of
+ * PRIMITIVE_LEN floats with wz varying fastest. Generated by motion_primitive_gen_node.
+ */
+
+#define PRIMITIVE_MAGIC 0x4d505241
+#define PRIMITIVE_VERSION 1
+#define PRIMITIVE_LEN 13
+
+//Entry fields. Displacements and velocities are in the start heading frame.
+enum{
+  PRIM_DX = 0, PRIM_DY, PRIM_DYAW,
+  PRIM_VX, PRIM_VY, PRIM_VZ,
+  PRIM_WX, PRIM_WY, PRIM_WZ,
+  PRIM_QD1, PRIM_QD2, PRIM_QD3, PRIM_QD4
+};
+
+struct PrimitiveTableHeader{
+  uint32_t magic;
+  uint32_t version;
+  int32_t soil_index; //into lookup_soil_table
+  float duration;
+  uint32_t num_wz, num_vf, num_v0, num_w0;
+  float wz_min, wz_max;
+  float vf_min, vf_max;
+  float v0_min, v0_max;
+  float w0_min, w0_max;
+};
+
+class MotionPrimitiveLibrary{
+public:
+  MotionPrimitiveLibrary();
+  ~MotionPrimitiveLibrary();
+
+  int load(const char *table_fn);
+  static int write(const char *table_fn, const PrimitiveTableHeader &header, const float *entries);
+  
+  void setTerrainMap(const TerrainMap *terrain_map){
+    terrain_map_ = terrain_map;
+  }
+  
+  //start and result are 17 element planner states. control is <Wz, Vf> like everywhere else.
+  int apply(const double *start, double Wz, double Vf, double duration, double *result) const;
+  
+  unsigned getNumTables() const{
+    return tables_.size();
+  }
+
+private:
+  struct Table{
+    PrimitiveTableHeader header;
+    float *entries;
+  };
+  
+  const Table* findTable(const BekkerData &soil) const;
+  int isFlat(float x, float y, float z_guess, float end_x, float end_y) const;
+  static int gridCoord(float value, float min, float max, uint32_t num, uint32_t &idx, float &t);
+  
+  std::vector<Table> tables_;
+  const TerrainMap *terrain_map_;
+  
+  float max_slope_;         //radians
+  float footprint_radius_;  //meters around the start and end that have to be flat
+  float max_lateral_speed_; //start states sliding sideways faster than this are simulated
+};
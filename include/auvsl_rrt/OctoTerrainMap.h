@@ -1,6 +1,8 @@
 #pragma once
 
 #include "TerrainMap.h"
+#include "DemReader.h"
+#include "ThreadPool.h"
 
 #include <octomap/octomap.h>
 #include <octomap_msgs/conversions.h>
@@ -28,14 +30,18 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <vector>
 
 
 class OctoTerrainMap : public TerrainMap{
 public:
-    OctoTerrainMap(const char *site_cloud_fn);
+    OctoTerrainMap();
+    OctoTerrainMap(const char *site_cloud_fn, const char *path_to_global_cloud = NULL); //NULL uses /TerrainMap/path_to_global_cloud
     ~OctoTerrainMap();
     
+    int loadDem(const char *dem_fn, const char *occ_fn);
+    
     BekkerData getSoilDataAt(float x, float y) const override;
     float getAltitude(float x, float y, float z_guess) const override;
     float averageNeighbors(float x, float y, float z_guess) const;
@@ -44,11 +50,37 @@ public:
 
     void computeOccupancyGrid(pcl::PointCloud<pcl::PointXYZ>::Ptr obstacle_cloud, float* temp_occ_grid);
     void computeElevationGrid(float *temp_elev_map);    
+    void fillHoles(float *grid, const unsigned char *holes);
+    int isObserved(float x, float y) const;
     void computeInflationGrid(float *costmap, float *inflated_costmap);
     void computePclOriginSize();
+    void segmentGroundGrid(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud, pcl::PointCloud<pcl::PointXYZ>::Ptr ground_cloud, pcl::PointCloud<pcl::PointXYZ>::Ptr obstacle_cloud,
+                           float cell_size, float height_threshold, float max_slope, float max_window);
+    void smoothGroundCloud(pcl::PointCloud<pcl::PointXYZ>::Ptr ground_cloud, float radius, pcl::PointCloud<pcl::PointXYZ> &smoothed);
+    void computeClearance(unsigned idx);
+    void insertObstaclePoints(const pcl::PointCloud<pcl::PointXYZ> &obstacle_cloud);
+    
+    //Edits to the unfiltered layers. Nothing is re-blurred until refilter.
+    //Return 0 on DEM maps, which have no unfiltered layers.
+    int setRawElevation(unsigned row, unsigned col, float z);
+    int setRawOccupancy(unsigned row, unsigned col, float occ);
+    void markDirty(unsigned min_row, unsigned min_col, unsigned max_row, unsigned max_col);
+    void refilter();
+    
+    //O(1) count of blocked cells from the summed area table.
+    unsigned countOccupied(unsigned min_row, unsigned min_col, unsigned max_row, unsigned max_col) const;
+    unsigned countOccupied(float min_x, float min_y, float max_x, float max_y) const;
   
     float getMapRes();
+    size_t getMemoryUsage() const;
+    //Grids a site of this size would need at /TerrainMap/elevation_map_res, before it is built. The octree isn't included.
+    static size_t estimateMemoryUsage(float width, float height);
+    //pcl_cloud and kdtree are shared by every map and hold the last site built from a cloud.
+    static size_t getSharedMemoryUsage();
+    int getOccupancyThreshold() const { return occupancy_threshold_; }
+    float getVehicleHeight() const { return vehicle_height_; }
     void getBounds(float &max_x, float &min_x, float &max_y, float &min_y) const override;
+    unsigned long getRevision() const override{ return revision_; }
   
     static void get_cloud_callback(const sensor_msgs::PointCloud2ConstPtr& msg);
 
@@ -65,13 +97,39 @@ public:
     
     float *occ_grid_blur_;
     float *elev_map_;
+    float *clearance_map_; //free space between the ground and the lowest obstacle voxel above it
+    uint64_t *occ_bits_; //1 where isStateValid fails. words_per_row_ words per row
+    unsigned *occ_sat_; //summed area table of occ_bits_, (rows_+1)*(cols_+1)
+    unsigned words_per_row_;
+    unsigned char *unobserved_; //1 where the elevation was interpolated rather than measured
     
 private:
+    void loadDemLayer(DemReader &reader, float *grid);
+    void initBlurKernel();
+    void blurRegion(unsigned min_row, unsigned min_col, unsigned max_row, unsigned max_col);
+    void updateOccupancyBits(unsigned min_row, unsigned min_col, unsigned max_row, unsigned max_col);
+    
+    float *raw_elev_map_; //before the blur. NULL for DEM maps
+    float *raw_occ_grid_;
+    float *blur_kernel_;
+    int kernel_size_;
+    
+    unsigned long revision_; //bumped by obstacle inserts and refilter
+    int is_dirty_; //raw cells changed since the last refilter, inside the dirty rectangle
+    unsigned dirty_min_row_;
+    unsigned dirty_min_col_;
+    unsigned dirty_max_row_;
+    unsigned dirty_max_col_;
+    
     octomap::OcTree* octomap_;
     
     int occupancy_threshold_;
+    bool reject_occupied_; //isStateValid only rejects occupied cells when this is set
+    float vehicle_height_;
+    float max_clearance_;
     
     ros::NodeHandle *private_nh_;
+    ThreadPool *pool_; //shared by the build stages
     ros::Publisher cloud_pub1_;
     ros::Publisher cloud_pub2_;
     
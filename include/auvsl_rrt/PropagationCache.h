@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <array>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include "TerrainMap.h"
+
+
+/*
+ * Bounded LRU cache of single propagations, keyed by the start state, control
+ * and duration snapped to a grid. A quantum of 0 keys on the exact bits, which
+ * only catches true replays. Larger quanta also catch near duplicate
+ * expansions. A hit from a nearby start is shifted by the difference in x and
+ * y, and its z follows the terrain under the shifted end like a motion
+ * primitive's does. Hits where that terrain differs from the cached end by
+ * more than max_terrain_delta are misses, the rest of the state is only good
+ * on locally flat ground. Without a terrain map only exact starts hit.
+ * Results depend on the terrain, so the cache has to be cleared whenever the
+ * map changes. Safe to use from every planning thread.
+ */
+
+class PropagationCache{
+public:
+  static const int STATE_LEN = 17;
+  static const int KEY_LEN = STATE_LEN + 3; //state, 2 controls, duration
+
+  PropagationCache(size_t capacity);
+
+  int lookup(const double *start, const double *control, double duration, double *result);
+  void insert(const double *start, const double *control, double duration, const double *result);
+  void clear();
+  
+  //Not owned. Set it again after clear when the map changes.
+  void setTerrainMap(const TerrainMap *terrain_map){
+    terrain_map_ = terrain_map;
+  }
+  
+  unsigned long getNumHits() const{ return num_hits_; }
+  unsigned long getNumMisses() const{ return num_misses_; }
+  unsigned long getNumEvictions() const{ return num_evictions_; }
+  size_t size();
+  
+  void printStats();
+
+private:
+  typedef std::array<int64_t, KEY_LEN> Key;
+  
+  struct KeyHash{
+    size_t operator()(const Key &key) const;
+  };
+  
+  struct Entry{
+    Key key;
+    double start_pos[2]; //x y
+    double result[STATE_LEN];
+  };
+  
+  void makeKey(const double *start, const double *control, double duration, Key &key) const;
+  static int64_t quantize(double value, double quantum);
+  
+  size_t capacity_;
+  double position_quantum_;
+  double orientation_quantum_;
+  double velocity_quantum_;
+  double control_quantum_;
+  double max_terrain_delta_;
+  const TerrainMap *terrain_map_;
+  
+  std::mutex mutex_;
+  std::list<Entry> entries_; //most recently used at the front
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index_;
+  
+  std::atomic<unsigned long> num_hits_;
+  std::atomic<unsigned long> num_misses_;
+  std::atomic<unsigned long> num_evictions_;
+};
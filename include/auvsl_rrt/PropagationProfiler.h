@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+
+/*
+ * Per thread counters for the propagation hot path.
+ * Every call is counted. One call in sample_interval is also timed with the
+ * cycle counter, split into integration, altitude queries and validity checks.
+ * Each thread only writes its own counters, so counting is a plain add with no
+ * shared cache lines. snapshot() sums every thread when the planner asks.
+ * Timed totals are scaled by calls/timed_calls to estimate the whole run.
+ */
+
+class PropagationProfiler{
+public:
+  struct Snapshot{
+    unsigned long calls;
+    unsigned long timed_calls;
+    unsigned long solver_steps;
+    unsigned long altitude_queries;
+    unsigned long validity_checks;
+    unsigned long conversions; //planner state <-> solver state copies
+    unsigned long rejected_steps; //adaptive steps thrown out for too much error
+    unsigned long primitive_hits;
+    unsigned long early_exits; //propagateUntilInvalid and rollout cut short
+    unsigned long solver_allocs;
+    unsigned long solver_inits;
+    double call_seconds; //estimated totals, scaled up from the timed calls
+    double integration_seconds;
+    double altitude_seconds; //part of integration_seconds
+    double validity_seconds;
+    unsigned num_threads;
+  };
+
+  class Counters{
+  public:
+    std::atomic<unsigned long> calls;
+    std::atomic<unsigned long> timed_calls;
+    std::atomic<unsigned long> solver_steps;
+    std::atomic<unsigned long> altitude_queries;
+    std::atomic<unsigned long> validity_checks;
+    std::atomic<unsigned long> conversions;
+    std::atomic<unsigned long> rejected_steps;
+    std::atomic<unsigned long> primitive_hits;
+    std::atomic<unsigned long> early_exits;
+    std::atomic<unsigned long> solver_allocs;
+    std::atomic<unsigned long> solver_inits;
+    std::atomic<uint64_t> call_ticks;
+    std::atomic<uint64_t> integration_ticks;
+    std::atomic<uint64_t> altitude_ticks;
+    std::atomic<uint64_t> validity_ticks;
+
+    bool timing; //inside a sampled call
+
+    //Only the owning thread writes, relaxed load and store is enough and avoids a locked add.
+    template<typename T>
+    inline void add(std::atomic<T> &counter, T amount){
+      counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    inline void startCall(){
+      add(calls, 1ul);
+      if(sample_interval_ && (++until_sample_ >= sample_interval_)){
+        until_sample_ = 0;
+        timing = true;
+        call_start_ = readTsc();
+      }
+    }
+    inline void endCall(){
+      if(timing){
+        add(call_ticks, readTsc() - call_start_);
+        add(timed_calls, 1ul);
+        timing = false;
+      }
+    }
+
+    //Section timing, free when the call isn't sampled.
+    inline uint64_t tick() const{
+      return timing ? readTsc() : 0;
+    }
+    inline void addTicks(std::atomic<uint64_t> &counter, uint64_t start){
+      if(timing){
+        add(counter, readTsc() - start);
+      }
+    }
+
+  private:
+    friend class PropagationProfiler;
+    Counters();
+    void clear();
+
+    unsigned until_sample_;
+    uint64_t call_start_;
+  };
+
+  //The calling thread's counters, registered on first use.
+  static Counters& local();
+
+  static Snapshot snapshot();
+  static Snapshot difference(const Snapshot &after, const Snapshot &before);
+  static void printSnapshot(const Snapshot &snap, double solve_seconds);
+
+  //Time one call in this many. 0 only counts.
+  static void setSampleInterval(unsigned sample_interval){
+    sample_interval_ = sample_interval;
+  }
+
+  static uint64_t readTsc();
+
+private:
+  struct Registration;
+
+  static double getTicksPerSecond();
+
+  static unsigned sample_interval_;
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "TerrainMap.h"
+#include "OctoTerrainMap.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+
+/*
+ * Finished terrain grids in a named POSIX shared memory segment.
+ * terrain_server_node builds an OctoTerrainMap once and publishes it. Every
+ * other process attaches read only, so the map is shared instead of rebuilt.
+ * Publishing again marks the old segment superseded. Clients keep their old
+ * copy until they call refresh.
+ *
+ * Segment layout is a SharedTerrainHeader followed by the elevation,
+ * occupancy and clearance grids, rows_*cols_ floats each, row major.
+ */
+
+#define SHARED_TERRAIN_MAGIC 0x54525641 //"AVRT"
+#define SHARED_TERRAIN_VERSION 2
+
+struct SharedTerrainHeader{
+  uint32_t magic; //written last, a segment without it is still being filled in
+  uint32_t version;
+  uint64_t segment_size;
+  
+  uint32_t rows;
+  uint32_t cols;
+  float map_res;
+  float x_origin;
+  float y_origin;
+  float x_max;
+  float y_max;
+  
+  float occupancy_threshold;
+  float vehicle_height;
+  
+  uint64_t elev_offset; //bytes from the start of the segment
+  uint64_t occ_offset;
+  uint64_t clearance_offset;
+  
+  uint32_t superseded; //set by the server once a newer map is published under the same name
+};
+
+
+class SharedTerrainMap : public TerrainMap{
+public:
+  SharedTerrainMap();
+  ~SharedTerrainMap();
+  
+  //Server side. Replaces any segment already using shm_name.
+  static int publish(const OctoTerrainMap *map, const char *shm_name);
+  static void unpublish(const char *shm_name);
+  
+  int attach(const char *shm_name);
+  void detach();
+  //Reattaches if the server published a newer map. Returns 1 if the map changed.
+  int refresh();
+  
+  BekkerData getSoilDataAt(float x, float y) const override;
+  float getAltitude(float x, float y, float z_guess) const override;
+  int isStateValid(float x, float y) const override;
+  std::vector<Rectangle*> getObstacles() const override;
+  void getBounds(float &max_x, float &min_x, float &max_y, float &min_y) const override;
+  unsigned long getRevision() const override{ return revision_; }
+  
+private:
+  static void markSuperseded(const char *shm_name);
+  
+  std::string shm_name_;
+  unsigned long revision_; //counts attaches
+  void *segment_;
+  size_t segment_size_;
+  const SharedTerrainHeader *header_;
+  
+  const float *elev_map_;
+  const float *occ_grid_blur_;
+  const float *clearance_map_;
+  
+  unsigned rows_;
+  unsigned cols_;
+  float map_res_;
+  float x_origin_;
+  float y_origin_;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+
+/*
+ * Times each stage of a terrain map build.
+ * Records wall time, process CPU time, peak RSS at the end of the stage and
+ * the stage's input and output sizes (points or cells). writeReport appends
+ * one CSV row per stage so builds can be compared across runs.
+ */
+
+class TerrainBuildProfiler{
+public:
+  TerrainBuildProfiler(const std::string &build_name);
+  
+  void begin(const char *stage, size_t input_size);
+  void end(size_t output_size);
+  
+  void printSummary() const;
+  int writeReport(const char *report_fn) const;
+  
+private:
+  struct Stage{
+    std::string name;
+    double wall_time; //seconds
+    double cpu_time; //seconds, all threads
+    long peak_rss_kb;
+    size_t input_size;
+    size_t output_size;
+  };
+  
+  static double getWallTime();
+  static double getCpuTime();
+  static long getPeakRssKb();
+  
+  std::string build_name_;
+  long start_timestamp_;
+  std::vector<Stage> stages_;
+  
+  double stage_wall_start_;
+  double stage_cpu_start_;
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "TerrainMap.h"
+#include "OctoTerrainMap.h"
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+
+/*
+ * Index of prebuilt site maps by bounding box.
+ * Maps are built on demand the first time a plan needs them. Before a site is
+ * built, least recently used ones are dropped until its estimated size fits
+ * in the memory budget. The cloud and kd tree OctoTerrainMap shares between
+ * all maps count against the budget too.
+ *
+ * Catalog file, one site per line. # starts a comment.
+ *   name cloud min_x min_y max_x max_y site_cloud.pcd processed_cloud_dir/
+ *   name dem   min_x min_y max_x max_y elevation.asc [occupancy.asc]
+ */
+
+class TerrainCatalog{
+public:
+  TerrainCatalog();
+  ~TerrainCatalog();
+
+  int load(const char *catalog_fn);
+  
+  //Smallest site that contains both points, or NULL if none do. The catalog owns the map.
+  const TerrainMap* getMap(float start_x, float start_y, float goal_x, float goal_y);
+  
+  size_t getMemoryUsage() const;
+  unsigned getNumSites() const{
+    return sites_.size();
+  }
+
+private:
+  struct Site{
+    std::string name;
+    std::string type;
+    float min_x, min_y, max_x, max_y;
+    std::string path;
+    std::string aux_path;
+    
+    OctoTerrainMap *map; //NULL when not resident
+    size_t memory_usage;
+    size_t expected_usage; //measured the last time it was resident, estimated from the bounds before that
+    unsigned long last_used;
+  };
+  
+  int loadSite(Site &site);
+  void evict(const Site *keep, size_t reserve);
+  
+  std::vector<Site> sites_;
+  size_t memory_budget_;
+  unsigned long use_counter_;
+};
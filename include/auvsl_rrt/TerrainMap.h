@@ -24,6 +24,8 @@ public:
   virtual int isStateValid(float x, float y) const = 0;
   virtual std::vector<Rectangle*> getObstacles() const = 0;
   virtual void getBounds(float &max_x, float &min_x, float &max_y, float &min_y) const = 0;
+  //Changes whenever the contents do, so results computed on the map can tell they are stale.
+  virtual unsigned long getRevision() const{ return 0; }
 };
 
 
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/*
+ * Fixed set of worker threads that run parallel for loops.
+ * The calling thread works too, as worker 0. Worker ids let callers keep
+ * per-worker scratch space without any locking.
+ */
+
+class ThreadPool{
+public:
+  ThreadPool(unsigned num_threads = 0); //0 means one per core
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  unsigned getNumThreads() const{
+    return threads_.size() + 1;
+  }
+
+  //Calls fn(i, worker) for every i in [0,n) and returns once they are all done.
+  void parallelFor(unsigned n, const std::function<void(unsigned, unsigned)> &fn);
+
+private:
+  void threadFunction(unsigned worker);
+  void runJob(unsigned worker);
+
+  std::vector<std::thread> threads_;
+
+  std::mutex call_mutex_; //one parallelFor at a time
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+
+  const std::function<void(unsigned, unsigned)> *job_;
+  unsigned job_size_;
+  std::atomic<unsigned> next_index_;
+  unsigned generation_;
+  unsigned num_busy_;
+  bool should_exit_;
+};
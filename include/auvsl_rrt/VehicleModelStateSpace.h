@@ -0,0 +1,109 @@
+#pragma once
+
+#include <ompl/base/StateSpace.h>
+#include <ompl/base/ProjectionEvaluator.h>
+#include <ompl/base/spaces/RealVectorBounds.h>
+
+#include <math.h>
+
+/*
+ * Planner state stored exactly the way HybridDynamics lays out its state, 21 floats:
+ *   0-3 qx qy qz qw,  4-6 x y z,  7-10 q1-4,  11-13 wx wy wz,  14-16 vx vy vz,  17-20 qd1-4
+ * q1-4 are the wheel joint angles. JackalStatePropagator zeroes them in every
+ * state it writes, the same as convert_to_model_space does for the other space.
+ * JackalStatePropagator copies these straight in and out of the solver instead of
+ * reordering through convert_to_model_space, and a state is half the size of a
+ * VehicleStateSpace state. Bounds are indexed in this layout too.
+ *
+ * Code that only needs the pose should go through getVehiclePose so it works
+ * with either vehicle space.
+ */
+
+namespace ompl{
+  namespace base{
+    //OMPL leaves type ids past STATE_SPACE_TYPE_COUNT for user spaces.
+    const int STATE_SPACE_VEHICLE_MODEL = STATE_SPACE_TYPE_COUNT + 1;
+    
+    class VehicleModelStateSampler : public StateSampler{
+    public:
+    VehicleModelStateSampler(const StateSpace *space) : StateSampler(space){}
+      void sampleUniform(State *state) override;
+      void sampleUniformNear(State *state, const State *near, double distance) override;
+      void sampleGaussian(State *state, const State *mean, double stdDev) override;
+    };
+    
+    class VehicleModelStateSpace : public StateSpace{
+    public:
+      static const unsigned int DIM = 21;
+      enum{ QX = 0, QY = 1, QZ = 2, QW = 3, X = 4, Y = 5, Z = 6, WX = 11, WY = 12, WZ = 13, VX = 14, VY = 15, VZ = 16, QD1 = 17 };
+      
+      class StateType : public State{
+      public:
+        StateType() = default;
+        
+        float getX() const{ return values[X]; }
+        float getY() const{ return values[Y]; }
+        float getZ() const{ return values[Z]; }
+        float getYaw() const{
+          return atan2f(2*((values[QW]*values[QZ]) + (values[QX]*values[QY])), 1 - 2*((values[QY]*values[QY]) + (values[QZ]*values[QZ])));
+        }
+        
+        const float *position() const{ return &values[X]; }
+        const float *orientation() const{ return &values[QX]; }
+        
+        float values[DIM];
+      };
+      
+      VehicleModelStateSpace();
+      ~VehicleModelStateSpace() override = default;
+      
+      void setBounds(const RealVectorBounds &bounds);
+      const RealVectorBounds &getBounds() const{
+        return bounds_;
+      }
+      
+      bool isMetricSpace() const override;
+      unsigned int getDimension() const override;
+      double getMaximumExtent() const override;
+      double getMeasure() const override;
+      void enforceBounds(State *state) const override;
+      bool satisfiesBounds(const State *state) const override;
+      void copyState(State *destination, const State *source) const override;
+      unsigned int getSerializationLength() const override;
+      void serialize(void *serialization, const State *state) const override;
+      void deserialize(State *state, const void *serialization) const override;
+      double distance(const State *state1, const State *state2) const override;
+      bool equalStates(const State *state1, const State *state2) const override;
+      void interpolate(const State *from, const State *to, double t, State *state) const override;
+      StateSamplerPtr allocDefaultStateSampler() const override;
+      State *allocState() const override;
+      void freeState(State *state) const override;
+      void printState(const State *state, std::ostream &out) const override;
+      void registerProjections() override;
+      void setup() override;
+      
+    protected:
+      RealVectorBounds bounds_;
+    };
+    
+    //x and y, for the nearest neighbor grids.
+    class VehicleModelProjectionEvaluator : public ProjectionEvaluator{
+    public:
+      VehicleModelProjectionEvaluator(const StateSpace *space);
+      unsigned int getDimension() const override;
+      void project(const State *state, Eigen::Ref<Eigen::VectorXd> projection) const override;
+    };
+  }
+}
+
+namespace auvsl{
+  //x y z qx qy qz qw of a state from either vehicle space. Same order as the first 7 planner values.
+  void getVehiclePose(const ompl::base::StateSpace *space, const ompl::base::State *state, double *pose);
+  
+  //Sets the pose from x y z qx qy qz qw and zeroes every velocity.
+  void initVehicleState(const ompl::base::StateSpace *space, ompl::base::State *state, const double *pose);
+  
+  inline bool isModelStateSpace(const ompl::base::StateSpace *space){
+    return space->getType() == ompl::base::STATE_SPACE_VEHICLE_MODEL;
+  }
+}
@@ -39,6 +39,7 @@
 #include "ompl/control/planners/PlannerIncludes.h"
 #include "ompl/datastructures/NearestNeighbors.h"
 #include "ControlSystem.h"
+#include "JackalStatePropagator.h"
 
 
  namespace ompl
@@ -52,7 +53,13 @@
   
              ~VehicleRRT() override;
 
-             unsigned controlWhileValid(const ompl::base::State *state, ompl::base::State *goal, unsigned steps, std::vector<base::State*> &result);
+             //controls, if given, gets a copy of the control applied to reach each state in result. Caller frees them.
+             unsigned controlWhileValid(const ompl::base::State *state, ompl::base::State *goal, unsigned steps, std::vector<base::State*> &result, std::vector<Control*> *controls = nullptr);
+
+             //Follows path from path[first_target] on with the control system, propagating with propagator instead
+             //of the planning model. Starts at tracked.back(), or path[0] when tracked is empty, and appends to tracked.
+             //Returns how many path states were reached. path.size() means the whole thing was tracked.
+             unsigned trackPath(const std::vector<base::State*> &path, unsigned first_target, const StatePropagatorPtr &propagator, double tolerance, std::vector<base::State*> &tracked);
            
              base::PlannerStatus solve(const base::PlannerTerminationCondition &ptc) override;
   
@@ -138,6 +145,9 @@
              RNG rng_;
   
              Motion *lastGoalMotion_{nullptr};
+  
+             //Reused by every expansion that goes through JackalStatePropagator::rollout.
+             Rollout rollout_;
          };
      }
  }
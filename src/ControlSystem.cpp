@@ -2,7 +2,7 @@
 #include "utils.h"
 #include <algorithm>
 
-#include <tf/tf.h>
+#include <math.h>
 
 using namespace auvsl;
 using namespace Eigen;
@@ -32,14 +32,17 @@ int SimpleControlSystem::initialize(){
 }
 
 int SimpleControlSystem::computeVelocityCommand(std::vector<Vector2f> waypoints, geometry_msgs::Pose pose, float &v_forward, float &v_angular){
-  tf::Quaternion quat(pose.orientation.x, pose.orientation.y, pose.orientation.z, pose.orientation.w);
-  tf::Matrix3x3 mat(quat);
-  double roll;
-  double pitch;
-  double yaw;
-  mat.getRPY(roll, pitch, yaw);
-  float dx = waypoints[1][0] - pose.position.x;
-  float dy = waypoints[1][1] - pose.position.y;
+  float quat[4] = {(float) pose.orientation.x, (float) pose.orientation.y, (float) pose.orientation.z, (float) pose.orientation.w};
+  computeCommand(pose.position.x, pose.position.y, quat, waypoints[1][0], waypoints[1][1], v_forward, v_angular);
+  return 1;
+}
+
+//Drives straight at the target, turning in place when it is far off the heading.
+void SimpleControlSystem::computeCommand(float x, float y, const float *quat, float target_x, float target_y, float &v_forward, float &v_angular){
+  //yaw as tf's getRPY has it, without building the rotation matrix
+  float yaw = atan2f(2*((quat[3]*quat[2]) + (quat[0]*quat[1])), 1 - 2*((quat[1]*quat[1]) + (quat[2]*quat[2])));
+  float dx = target_x - x;
+  float dy = target_y - y;
   
   float dist = sqrtf(dx*dx + dy*dy);
   
@@ -58,9 +61,6 @@ int SimpleControlSystem::computeVelocityCommand(std::vector<Vector2f> waypoints,
   if(fabs(ang_disp) > .5){
     v_forward *= .01;
   }
-  
-  
-  return 1;
 }
 
 
@@ -0,0 +1,206 @@
+#include "DemReader.h"
+
+#include <ros/ros.h>
+
+#include <algorithm>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+
+//Whole value has to parse. Returns 0 on junk so a bad header fails instead of throwing.
+static int parseUnsigned(const std::string &value, unsigned &result){
+  char *end;
+  unsigned long temp = strtoul(value.c_str(), &end, 10);
+  if(value.empty() || *end != '\0' || value[0] == '-'){
+    return 0;
+  }
+  result = (unsigned) temp;
+  return 1;
+}
+
+static int parseFloat(const std::string &value, float &result){
+  char *end;
+  float temp = strtof(value.c_str(), &end);
+  if(value.empty() || *end != '\0'){
+    return 0;
+  }
+  result = temp;
+  return 1;
+}
+
+
+
+DemReader::DemReader(){
+  ncols_ = 0;
+  nrows_ = 0;
+  xllcorner_ = 0;
+  yllcorner_ = 0;
+  cellsize_ = 0;
+  nodata_ = -9999;
+  is_binary_ = 0;
+  is_msb_first_ = 0;
+  rows_read_ = 0;
+}
+
+DemReader::~DemReader(){
+  close();
+}
+
+void DemReader::close(){
+  if(data_file_.is_open()){
+    data_file_.close();
+  }
+}
+
+//Header is the same for .asc and .hdr files. A list of "key value" lines.
+//For .asc files the header stops at the first line that doesn't start with a letter.
+int DemReader::readHeader(std::ifstream &header_file){
+  std::string key;
+  std::string value;
+  int x_is_center = 0;
+  int y_is_center = 0;
+
+  while(header_file >> std::ws, isalpha(header_file.peek())){
+    header_file >> key >> value;
+    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+
+    int ok = 1;
+    if(key == "ncols"){
+      ok = parseUnsigned(value, ncols_);
+    }
+    else if(key == "nrows"){
+      ok = parseUnsigned(value, nrows_);
+    }
+    else if(key == "xllcorner"){
+      ok = parseFloat(value, xllcorner_);
+    }
+    else if(key == "xllcenter"){
+      ok = parseFloat(value, xllcorner_);
+      x_is_center = 1;
+    }
+    else if(key == "yllcorner"){
+      ok = parseFloat(value, yllcorner_);
+    }
+    else if(key == "yllcenter"){
+      ok = parseFloat(value, yllcorner_);
+      y_is_center = 1;
+    }
+    else if(key == "cellsize"){
+      ok = parseFloat(value, cellsize_);
+    }
+    else if(key == "nodata_value"){
+      ok = parseFloat(value, nodata_);
+    }
+    else if(key == "byteorder"){
+      std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+      if((value == "msbfirst") || (value == "m")){
+        is_msb_first_ = 1;
+      }
+      else if((value == "lsbfirst") || (value == "i")){
+        is_msb_first_ = 0;
+      }
+      else{
+        ok = 0;
+      }
+    }
+    else{
+      ROS_INFO("DemReader ignoring header key %s", key.c_str());
+    }
+
+    if(!ok){
+      ROS_INFO("DemReader bad header value %s for %s", value.c_str(), key.c_str());
+      return 0;
+    }
+  }
+
+  if(x_is_center){
+    xllcorner_ -= .5f*cellsize_;
+  }
+  if(y_is_center){
+    yllcorner_ -= .5f*cellsize_;
+  }
+
+  if(ncols_ == 0 || nrows_ == 0 || cellsize_ <= 0){
+    ROS_INFO("DemReader bad header ncols %u  nrows %u  cellsize %f", ncols_, nrows_, cellsize_);
+    return 0;
+  }
+  return 1;
+}
+
+int DemReader::open(const char *dem_fn){
+  close();
+  rows_read_ = 0;
+
+  std::string fn(dem_fn);
+  std::string ext = fn.substr(fn.find_last_of('.') + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+  if(ext == "flt"){
+    //binary grid. Header lives next to it in a .hdr file
+    is_binary_ = 1;
+    std::string header_fn = fn.substr(0, fn.find_last_of('.')) + ".hdr";
+    std::ifstream header_file(header_fn.c_str());
+    if(!header_file.is_open() || !readHeader(header_file)){
+      ROS_INFO("DemReader could not read header %s", header_fn.c_str());
+      return 0;
+    }
+    data_file_.open(dem_fn, std::ifstream::in | std::ifstream::binary);
+  }
+  else{
+    is_binary_ = 0;
+    data_file_.open(dem_fn, std::ifstream::in);
+    if(!data_file_.is_open() || !readHeader(data_file_)){
+      ROS_INFO("DemReader could not read header %s", dem_fn);
+      return 0;
+    }
+  }
+
+  if(!data_file_.is_open()){
+    ROS_INFO("DemReader could not open %s", dem_fn);
+    return 0;
+  }
+
+  ROS_INFO("DemReader %s: %u cols  %u rows  cellsize %f  origin <%f %f>", dem_fn, ncols_, nrows_, cellsize_, xllcorner_, yllcorner_);
+  return 1;
+}
+
+int DemReader::readRow(float *row){
+  if(rows_read_ >= nrows_){
+    return 0;
+  }
+
+  if(is_binary_){
+    data_file_.read((char*) row, ncols_*sizeof(float));
+
+    //Swap when the file's byte order differs from the host's.
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    const int host_is_msb_first = 1;
+#else
+    const int host_is_msb_first = 0;
+#endif
+    if(is_msb_first_ != host_is_msb_first){
+      uint32_t temp;
+      for(unsigned i = 0; i < ncols_; i++){
+        memcpy(&temp, &row[i], sizeof(float));
+        temp = __builtin_bswap32(temp);
+        memcpy(&row[i], &temp, sizeof(float));
+      }
+    }
+  }
+  else{
+    for(unsigned i = 0; i < ncols_; i++){
+      data_file_ >> row[i];
+    }
+  }
+
+  if(!data_file_){
+    ROS_INFO("DemReader ran out of data on row %u", rows_read_);
+    return 0;
+  }
+
+  rows_read_++;
+  return 1;
+}
@@ -38,12 +38,122 @@
 #include "ompl/control/SpaceInformation.h"
 #include "ompl/control/spaces/RealVectorControlSpace.h"
 #include "ompl/base/spaces/RealVectorStateSpace.h"
+#include "VehicleModelStateSpace.h"
 #include <rbdl/rbdl.h>
 
+#include <algorithm>
+
 DirectedVehicleControlSampler::DirectedVehicleControlSampler(const ompl::control::SpaceInformation *si, unsigned int k)
-  : DirectedControlSampler(si), cs_(si->allocControlSampler()), numControlSamples_(k){}
+  : DirectedControlSampler(si), cs_(si->allocControlSampler()), numControlSamples_(k){
+}
+  
+DirectedVehicleControlSampler::~DirectedVehicleControlSampler(){
+  freeCandidates();
+}
+
+//Grows the candidate scratch to numControlSamples_. Only allocates when k goes up.
+void DirectedVehicleControlSampler::allocCandidates(){
+  unsigned int k = std::max(numControlSamples_, 1u);
+  while(candidate_controls_.size() < k){
+    candidate_controls_.push_back(si_->allocControl());
+    candidate_states_.push_back(si_->allocState());
+    scratch_states_.push_back(si_->allocState());
+  }
+  candidate_steps_.resize(candidate_controls_.size());
+  candidate_distances_.resize(candidate_controls_.size());
+  target_steps_.resize(candidate_controls_.size());
+}
+
+void DirectedVehicleControlSampler::freeCandidates(){
+  for(unsigned int i = 0; i < candidate_controls_.size(); i++){
+    si_->freeControl(candidate_controls_[i]);
+    si_->freeState(candidate_states_[i]);
+    si_->freeState(scratch_states_[i]);
+  }
+  candidate_controls_.clear();
+  candidate_states_.clear();
+  scratch_states_.clear();
+}
+
+//Same as SpaceInformation::propagateWhileValid, but ping pongs between result and
+//scratch instead of allocating a temporary state every call.
+unsigned int DirectedVehicleControlSampler::propagateWhileValid(const ompl::base::State *source, const ompl::control::Control *control, unsigned int steps, ompl::base::State *result, ompl::base::State *scratch) const{
+  if(steps == 0){
+    si_->copyState(result, source);
+    return 0;
+  }
   
-DirectedVehicleControlSampler::~DirectedVehicleControlSampler() = default;
+  double step_size = si_->getPropagationStepSize();
+  const ompl::control::StatePropagatorPtr &propagator = si_->getStatePropagator();
+  
+  propagator->propagate(source, control, step_size, result);
+  if(!si_->isValid(result)){
+    si_->copyState(result, source);
+    return 0;
+  }
+  
+  ompl::base::State *current = result;
+  ompl::base::State *next = scratch;
+  unsigned int valid_steps = steps;
+  for(unsigned int i = 1; i < steps; i++){
+    propagator->propagate(current, control, step_size, next);
+    if(!si_->isValid(next)){
+      valid_steps = i;
+      break;
+    }
+    std::swap(current, next);
+  }
+  
+  if(current != result){
+    si_->copyState(result, current);
+  }
+  return valid_steps;
+}
+  
+//propagateWhileValid for all k candidates at once. Every candidate still going advances
+//one step per propagateBatch, so each stops at its own first invalid step, same as the
+//serial loop. candidate_steps_ goes in as the requested steps and comes out as the valid ones.
+void DirectedVehicleControlSampler::propagateCandidates(const JackalStatePropagator *propagator, const ompl::base::State *source, unsigned int k){
+  double step_size = si_->getPropagationStepSize();
+  for(unsigned int i = 0; i < k; i++){
+    target_steps_[i] = candidate_steps_[i];
+    candidate_steps_[i] = 0;
+    si_->copyState(candidate_states_[i], source);
+  }
+  
+  while(true){
+    batch_index_.clear();
+    batch_states_.clear();
+    batch_controls_.clear();
+    batch_durations_.clear();
+    batch_results_.clear();
+    for(unsigned int i = 0; i < k; i++){
+      if(candidate_steps_[i] < target_steps_[i]){
+        batch_index_.push_back(i);
+        batch_states_.push_back(candidate_states_[i]);
+        batch_controls_.push_back(candidate_controls_[i]);
+        batch_durations_.push_back(step_size);
+        batch_results_.push_back(scratch_states_[i]);
+      }
+    }
+    if(batch_index_.empty()){
+      break;
+    }
+    
+    propagator->propagateBatch(batch_states_, batch_controls_, batch_durations_, batch_results_, batch_steps_, batch_valid_);
+    
+    for(unsigned int b = 0; b < batch_index_.size(); b++){
+      unsigned int i = batch_index_[b];
+      if(batch_valid_[b]){
+        std::swap(candidate_states_[i], scratch_states_[i]);
+        candidate_steps_[i]++;
+      }
+      else{
+        target_steps_[i] = candidate_steps_[i];
+      }
+    }
+  }
+}
   
 unsigned int DirectedVehicleControlSampler::sampleTo(ompl::control::Control *control, const ompl::base::State *source, ompl::base::State *dest){
   return getBestControl(control, source, dest, nullptr);
@@ -64,52 +174,42 @@ unsigned int DirectedVehicleControlSampler::getBestControl(ompl::control::Contro
   const unsigned int minDuration = si_->getMinControlDuration();
   const unsigned int maxDuration = si_->getMaxControlDuration();
   
-  unsigned int steps = cs_->sampleStepCount(minDuration, maxDuration);
+  allocCandidates();
+  unsigned int k = std::max(numControlSamples_, 1u);
+  
+  //Controls are drawn here, in the same order the serial loop drew them, so a seed
+  //gives the same candidates no matter how many threads propagate them.
+  for (unsigned int i = 0; i < k; ++i)
+    {
+      candidate_steps_[i] = cs_->sampleStepCount(minDuration, maxDuration);
+      sampleControlHeuristic(candidate_controls_[i], source, dest, previous, candidate_steps_[i]);
+    }
   
-  sampleControlHeuristic(control, source, dest, previous, steps);
+  //Looked up every call, GlobalPlanner swaps the propagator between the dynamic and kinematic models.
+  const JackalStatePropagator *propagator = dynamic_cast<const JackalStatePropagator*>(si_->getStatePropagator().get());
+  if(propagator){
+    propagateCandidates(propagator, source, k);
+  }
+  else{
+    for (unsigned int i = 0; i < k; ++i)
+      candidate_steps_[i] = propagateWhileValid(source, candidate_controls_[i], candidate_steps_[i], candidate_states_[i], scratch_states_[i]);
+  }
   
-  // Propagate the first control, and find how far it is from the target state
-  ompl::base::State *bestState = si_->allocState();
-  steps = si_->propagateWhileValid(source, control, steps, bestState);
+  for (unsigned int i = 0; i < k; ++i)
+    candidate_distances_[i] = si_->distance(candidate_states_[i], dest);
   
-  if (numControlSamples_ > 1)
+  // Save the control that gets closest to target. Ties go to the earlier sample, like before.
+  unsigned int best = 0;
+  for (unsigned int i = 1; i < k; ++i)
     {
-      ompl::control::Control *tempControl = si_->allocControl();
-      ompl::base::State *tempState = si_->allocState();
-      double bestDistance = si_->distance(bestState, dest);
-  
-      // Sample k-1 more controls, and save the control that gets closest to target
-      for (unsigned int i = 1; i < numControlSamples_; ++i)
-        {
-          unsigned int sampleSteps = cs_->sampleStepCount(minDuration, maxDuration);
-          /*
-          if (previous != nullptr)
-            cs_->sampleNext(tempControl, previous, source);
-          else
-            cs_->sample(tempControl, source);
-          */
-          sampleControlHeuristic(tempControl, source, dest, previous, sampleSteps);
-          
-          sampleSteps = si_->propagateWhileValid(source, tempControl, sampleSteps, tempState);
-          double tempDistance = si_->distance(tempState, dest);
-          if (tempDistance < bestDistance)
-            {
-              si_->copyState(bestState, tempState);
-              si_->copyControl(control, tempControl);
-              
-              bestDistance = tempDistance;
-              steps = sampleSteps;
-            }
-        }
-  
-      si_->freeState(tempState);
-      si_->freeControl(tempControl);
+      if (candidate_distances_[i] < candidate_distances_[best])
+        best = i;
     }
   
-  si_->copyState(dest, bestState);
-  si_->freeState(bestState);
+  si_->copyControl(control, candidate_controls_[best]);
+  si_->copyState(dest, candidate_states_[best]);
   
-  return steps;
+  return candidate_steps_[best];
 }
 
 
@@ -117,8 +217,10 @@ unsigned int DirectedVehicleControlSampler::getBestControl(ompl::control::Contro
 
 void DirectedVehicleControlSampler::sampleControlHeuristic(ompl::control::Control *control, const ompl::base::State *source, ompl::base::State *dest, const ompl::control::Control *previous, unsigned steps){
   double *control_vector = control->as<ompl::control::RealVectorControlSpace::ControlType>()->values;
-  const double* source_vector = source->as<ompl::base::RealVectorStateSpace::StateType>()->values;
-  const double* dest_vector = dest->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+  double source_vector[7];
+  double dest_vector[7];
+  auvsl::getVehiclePose(si_->getStateSpace().get(), source, source_vector);
+  auvsl::getVehiclePose(si_->getStateSpace().get(), dest, dest_vector);
   
   //ROS_INFO("Source Vector %f %f", source_vector[0], source_vector[1]);
   //ROS_INFO("Dest Vector %f %f", dest_vector[0], dest_vector[1]);
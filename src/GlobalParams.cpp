@@ -26,6 +26,20 @@ float GlobalParams::forward_variance;
 float GlobalParams::p_gain;
 float GlobalParams::goal_tolerance;
 float GlobalParams::max_gp_runtime;
+int GlobalParams::num_threads;
+
+bool GlobalParams::adaptive_integration;
+float GlobalParams::integration_tolerance;
+float GlobalParams::integration_rel_tolerance;
+int GlobalParams::max_step_scale;
+
+bool GlobalParams::two_fidelity_planning;
+float GlobalParams::kinematic_turn_efficiency;
+float GlobalParams::kinematic_slip;
+float GlobalParams::verify_tolerance;
+float GlobalParams::track_min_speed;
+int GlobalParams::validity_check_interval;
+bool GlobalParams::use_model_state_space;
 
 
 void GlobalParams::load_params(ros::NodeHandle *nh){
@@ -56,6 +70,21 @@ void GlobalParams::load_params(ros::NodeHandle *nh){
 
   nh->getParam("/goal_tolerance", goal_tolerance);
   nh->getParam("/max_gp_runtime", max_gp_runtime);
+  nh->getParam("/num_threads", num_threads);
+
+  nh->getParam("/adaptive_integration", adaptive_integration);
+  nh->getParam("/integration_tolerance", integration_tolerance);
+  nh->getParam("/integration_rel_tolerance", integration_rel_tolerance);
+  nh->getParam("/max_step_scale", max_step_scale);
+
+  nh->getParam("/two_fidelity_planning", two_fidelity_planning);
+  nh->getParam("/kinematic_turn_efficiency", kinematic_turn_efficiency);
+  nh->getParam("/kinematic_slip", kinematic_slip);
+  nh->getParam("/verify_tolerance", verify_tolerance);
+  track_min_speed = .2;
+  nh->getParam("/track_min_speed", track_min_speed);
+  nh->getParam("/validity_check_interval", validity_check_interval);
+  nh->getParam("/use_model_state_space", use_model_state_space);
 
 }
 
@@ -88,3 +117,17 @@ float GlobalParams::get_forward_variance(){return GlobalParams::forward_variance
 float GlobalParams::get_p_gain(){return GlobalParams::p_gain;}
 float GlobalParams::get_goal_tolerance(){return GlobalParams::goal_tolerance;}
 float GlobalParams::get_max_gp_runtime(){return GlobalParams::max_gp_runtime;}
+int   GlobalParams::get_num_threads(){return GlobalParams::num_threads;}
+
+bool  GlobalParams::get_adaptive_integration(){return GlobalParams::adaptive_integration;}
+float GlobalParams::get_integration_tolerance(){return GlobalParams::integration_tolerance;}
+float GlobalParams::get_integration_rel_tolerance(){return GlobalParams::integration_rel_tolerance;}
+int   GlobalParams::get_max_step_scale(){return GlobalParams::max_step_scale;}
+
+bool  GlobalParams::get_two_fidelity_planning(){return GlobalParams::two_fidelity_planning;}
+float GlobalParams::get_kinematic_turn_efficiency(){return GlobalParams::kinematic_turn_efficiency;}
+float GlobalParams::get_kinematic_slip(){return GlobalParams::kinematic_slip;}
+float GlobalParams::get_verify_tolerance(){return GlobalParams::verify_tolerance;}
+float GlobalParams::get_track_min_speed(){return GlobalParams::track_min_speed;}
+int   GlobalParams::get_validity_check_interval(){return GlobalParams::validity_check_interval;}
+bool  GlobalParams::get_use_model_state_space(){return GlobalParams::use_model_state_space;}
@@ -4,9 +4,14 @@
 #include <memory>
 #include <math.h>
 #include <functional>
+#include <algorithm>
+#include <limits>
 
 #include "GlobalPlanner.h"
 #include "JackalStatePropagator.h"
+#include "KinematicStatePropagator.h"
+#include "VehicleModelStateSpace.h"
+#include "PropagationProfiler.h"
 #include "GlobalParams.h"
 #include "PlannerVisualizer.h"
 #include "VehicleControlSampler.h"
@@ -18,7 +23,9 @@
 
 #include <ompl/util/RandomNumbers.h>
 #include <ompl/base/goals/GoalSpace.h>
+#include <ompl/base/goals/GoalSampleableRegion.h>
 #include <ompl/control/SimpleDirectedControlSampler.h>
+#include <ompl/util/Time.h>
 
 #include <assert.h>
 #include <string>
@@ -35,6 +42,57 @@
 
 namespace auvsl{
 
+  //Any state within tolerance (x y) of a kinematic path state from first on. Repairs aim here
+  //so the dynamics can rejoin the kinematic path wherever it gets back to it.
+  class PathRejoinGoal : public ompl::base::GoalSampleableRegion{
+  public:
+    PathRejoinGoal(const ompl::base::SpaceInformationPtr &si, const std::vector<ompl::base::State*> &path, unsigned first, double tolerance)
+      : GoalSampleableRegion(si), path_(path), first_(first){
+      setThreshold(tolerance);
+    }
+    
+    double distanceGoal(const ompl::base::State *st) const override{
+      unsigned idx;
+      return nearest(st, idx);
+    }
+    
+    void sampleGoal(ompl::base::State *st) const override{
+      si_->copyState(st, path_[first_ + rng_.uniformInt(0, path_.size() - 1 - first_)]);
+    }
+    
+    unsigned int maxSampleCount() const override{
+      return path_.size() - first_;
+    }
+    
+    unsigned getRejoinIndex(const ompl::base::State *st) const{
+      unsigned idx;
+      nearest(st, idx);
+      return idx;
+    }
+    
+  private:
+    double nearest(const ompl::base::State *st, unsigned &idx) const{
+      double pose[7];
+      getVehiclePose(si_->getStateSpace().get(), st, pose);
+      double best = std::numeric_limits<double>::infinity();
+      idx = first_;
+      for(unsigned i = first_; i < path_.size(); i++){
+        double path_pose[7];
+        getVehiclePose(si_->getStateSpace().get(), path_[i], path_pose);
+        double dist = sqrt(((pose[0]-path_pose[0])*(pose[0]-path_pose[0])) + ((pose[1]-path_pose[1])*(pose[1]-path_pose[1])));
+        if(dist < best){
+          best = dist;
+          idx = i;
+        }
+      }
+      return best;
+    }
+    
+    const std::vector<ompl::base::State*> &path_;
+    unsigned first_;
+    mutable ompl::RNG rng_;
+  };
+
 
   //statics
   const TerrainMap *GlobalPlanner::global_map_;
@@ -55,10 +113,17 @@ namespace auvsl{
 
   GlobalPlanner::GlobalPlanner(){
     //G_TOLERANCE_ = GlobalParams::get_goal_tolerance();
+    catalog_ = NULL;
+    shared_map_ = NULL;
+    local_map_ = NULL;
+    primitives_ = NULL;
+    cache_map_ = NULL;
+    cache_revision_ = 0;
   }
 
   bool GlobalPlanner::isStateValid(const ompl::base::State *state){
-    const ompl::base::VehicleStateSpace::StateType& state_vector = *state->as<ompl::base::VehicleStateSpace::StateType>();
+    double state_vector[7];
+    getVehiclePose(space_ptr_.get(), state, state_vector);
   
     //test for roll over
     RigidBodyDynamics::Math::Quaternion quat(state_vector[3], state_vector[4], state_vector[5], state_vector[6]);
@@ -76,68 +141,61 @@ namespace auvsl{
     return global_map_->isStateValid(state_vector[0], state_vector[1]);
   }
 
+  //Same tests as isStateValid on the dynamics' own state layout, cheap enough to run between solver steps.
+  //Only x, y, z are bounds checked. isStateValid still checks the whole state at the end of the step.
+  bool GlobalPlanner::isModelStateValid(const float *model_state){
+    float qx = model_state[0];
+    float qy = model_state[1];
+    if((1 - 2*((qx*qx) + (qy*qy))) < 0){ //z component of the body z axis
+      return false;
+    }
+    
+    const ompl::base::RealVectorBounds &bounds = getSpaceBounds();
+    unsigned first = isModelStateSpace(space_ptr_.get()) ? ompl::base::VehicleModelStateSpace::X : 0;
+    for(int i = 0; i < 3; i++){
+      if(model_state[4+i] < bounds.low[first+i] || model_state[4+i] > bounds.high[first+i]){
+        return false;
+      }
+    }
+    
+    return global_map_->isStateValid(model_state[4], model_state[5]);
+  }
+
 
 
   GlobalPlanner::~GlobalPlanner(){
+    delete catalog_;
+    delete shared_map_;
+    delete local_map_;
+    delete primitives_;
     ROS_INFO("RRT Destruct GP");
   
   }
 
 
-  void GlobalPlanner::getWaypoints(std::vector<ompl::control::Control*> &controls, std::vector<double> &durations, std::vector<ompl::base::State*> states, std::vector<geometry_msgs::PoseStamped> &waypoints, unsigned &num_waypoints){
+  //Path states are the trajectory the tree actually produced, one per propagation step.
+  //Nothing gets simulated again, so this is cheap and can't drift from the tree.
+  void GlobalPlanner::statesToWaypoints(const std::vector<ompl::base::State*> &states, std::vector<geometry_msgs::PoseStamped> &waypoints){
     waypoints.clear();
-  
-    unsigned vehicle_state_len = 21;
-  
-    ompl::base::State *start_state = si_->allocState();
-    ompl::base::State *result_state = si_->allocState();
-  
-  
-    //initialize with start state
-    si_->copyState(start_state, states[0]);
-    const double* start_val = start_state->as<ompl::base::RealVectorStateSpace::StateType>()->values;
-  
-  
-    geometry_msgs::PoseStamped start_pose;
-    start_pose.pose.position.x = start_val[0];
-    start_pose.pose.position.y = start_val[1];
-    start_pose.pose.position.z = start_val[2]; //Not used.
-
-    start_pose.pose.orientation.x = start_val[3];
-    start_pose.pose.orientation.y = start_val[4];
-    start_pose.pose.orientation.z = start_val[5];
-    start_pose.pose.orientation.w = start_val[6];
-  
-    waypoints.push_back(start_pose);
-  
-  
-    ROS_INFO("RRT Num controls %ld     num durations %ld    num states %ld", controls.size(), durations.size(), states.size()); //Sanity check.
-
-    geometry_msgs::PoseStamped temp_pose;
-    //Iterate through the controls.
-    for(unsigned i = 0; i < controls.size(); i++){
-      const double *control_vector = controls[i]->as<ompl::control::RealVectorControlSpace::ControlType>()->values;
-    
-      si_->propagateWhileValid(start_state, controls[i], round(durations[i]/si_->getPropagationStepSize()), result_state);
-      si_->copyState(start_state, result_state);
-    
-      const double* result_val = result_state->as<ompl::base::RealVectorStateSpace::StateType>()->values;
-      ROS_INFO("RRT Waypoint %d  %f %f", i, result_val[0], result_val[1]);
-    
-      temp_pose.pose.position.x = result_val[0];
-      temp_pose.pose.position.y = result_val[1];
-      temp_pose.pose.position.z = result_val[2]; //Not used.
-    
-      temp_pose.pose.orientation.x = result_val[3];
-      temp_pose.pose.orientation.y = result_val[4];
-      temp_pose.pose.orientation.z = result_val[5];
-      temp_pose.pose.orientation.w = result_val[6];
     
+    geometry_msgs::PoseStamped temp_pose;
+    for(unsigned i = 0; i < states.size(); i++){
+      double val[7];
+      getVehiclePose(space_ptr_.get(), states[i], val);
+      
+      temp_pose.pose.position.x = val[0];
+      temp_pose.pose.position.y = val[1];
+      temp_pose.pose.position.z = val[2]; //Not used.
+      
+      temp_pose.pose.orientation.x = val[3];
+      temp_pose.pose.orientation.y = val[4];
+      temp_pose.pose.orientation.z = val[5];
+      temp_pose.pose.orientation.w = val[6];
+      
       waypoints.push_back(temp_pose);
     }
-  
-    num_waypoints = waypoints.size();
-    ROS_INFO("RRT Got all the waypoints.");
+    
+    ROS_INFO("RRT Got %lu waypoints from states", waypoints.size());
   }
 
 
@@ -149,38 +207,109 @@ namespace auvsl{
     ompl::RNG::setSeed(GlobalParams::get_seed());
 
 
-    SimpleTerrainMap *simple_map = new SimpleTerrainMap();
-    simple_map->generateObstacles();
-    global_map_ = simple_map;
+    //With a catalog the map isn't known until makePlan sees the start and goal.
+    std::string catalog_fn;
+    nh.getParam("/TerrainCatalog/catalog_filename", catalog_fn);
+    if(!catalog_fn.empty()){
+      catalog_ = new TerrainCatalog();
+      if(!catalog_->load(catalog_fn.c_str())){
+        delete catalog_;
+        catalog_ = NULL;
+      }
+    }
+    
+    bool use_shared_map = false;
+    std::string shm_name = "/auvsl_terrain_map";
+    nh.getParam("/TerrainServer/use_shared_map", use_shared_map);
+    nh.getParam("/TerrainServer/shm_name", shm_name);
+    if(!catalog_ && use_shared_map){
+      shared_map_ = new SharedTerrainMap();
+      if(!shared_map_->attach(shm_name.c_str())){
+        delete shared_map_;
+        shared_map_ = NULL;
+      }
+    }
+    
+    bool use_local_map = false;
+    nh.getParam("/LocalMap/use_local_map", use_local_map);
+    if(!catalog_ && !shared_map_ && use_local_map){
+      local_map_ = new LocalTerrainMap();
+    }
+    
+    if(catalog_){
+      global_map_ = NULL;
+    }
+    else if(shared_map_){
+      global_map_ = shared_map_;
+    }
+    else if(local_map_){
+      global_map_ = local_map_;
+    }
+    else{
+      SimpleTerrainMap *simple_map = new SimpleTerrainMap();
+      simple_map->generateObstacles();
+      global_map_ = simple_map;
+    }
     std::string site_cloud_fn;
     nh.getParam("/TerrainMap/site_cloud_filename", site_cloud_fn);
     //global_map_ =  new OctoTerrainMap(site_cloud_fn.c_str());
+    int profile_sample_interval = 64;
+    nh.getParam("/PropagationProfiler/sample_interval", profile_sample_interval);
+    PropagationProfiler::setSampleInterval(std::max(0, profile_sample_interval));
+    
+    //Altitude queries come from inside HybridDynamics::step, on the propagating thread.
     HybridDynamics::setAltitudeMap(
-                                   [global_map_](float x, float y, float z_guess){ return global_map_->getAltitude(x, y, z_guess);}
+                                   [global_map_](float x, float y, float z_guess){
+                                     PropagationProfiler::Counters &prof = PropagationProfiler::local();
+                                     prof.add(prof.altitude_queries, 1ul);
+                                     uint64_t altitude_start = prof.tick();
+                                     float alt = global_map_->getAltitude(x, y, z_guess);
+                                     prof.addTicks(prof.altitude_ticks, altitude_start);
+                                     return alt;
+                                   }
                                    );
-
-    float max_x, max_y, min_x, min_y;
-    global_map_->getBounds(max_x, min_x,  max_y, min_y);
-    ROS_INFO("RRT Bounds %f %f  %f %f", min_x, max_x, min_y, max_y);
+    
+    if(GlobalParams::get_use_model_state_space()){
+      //HybridDynamics layout, see VehicleModelStateSpace.h
+      ompl::base::VehicleModelStateSpace *space = new ompl::base::VehicleModelStateSpace();
+      ompl::base::RealVectorBounds bounds(ompl::base::VehicleModelStateSpace::DIM);
+      for(unsigned i = 0; i < 4; i++){ //quaternion
+        bounds.setLow(i, -2.01); bounds.setHigh(i, 2.01);
+      }
+      bounds.setLow(4, -1); bounds.setHigh(4, 1); //x and y are set by setMapBounds
+      bounds.setLow(5, -1); bounds.setHigh(5, 1);
+      bounds.setLow(6, -100); bounds.setHigh(6, 100); //z
+      for(unsigned i = 7; i < 11; i++){ //wheel joint angles, zeroed after every propagation
+        bounds.setLow(i, -1); bounds.setHigh(i, 1);
+      }
+      for(unsigned i = 11; i < ompl::base::VehicleModelStateSpace::DIM; i++){
+        bounds.setLow(i, -2000); bounds.setHigh(i, 2000);
+      }
+      space->setBounds(bounds);
+      space_ptr_ = ompl::base::StateSpacePtr(space);
+    }
+    else{
+      ompl::base::VehicleStateSpace *space = new ompl::base::VehicleStateSpace(17); 
+      ompl::base::RealVectorBounds bounds(17);
+      bounds.setLow(0, -1); bounds.setHigh(0, 1); //x and y are set by setMapBounds
+      bounds.setLow(1, -1); bounds.setHigh(1, 1);
+      bounds.setLow(2, -100); bounds.setHigh(2, 100); //z
+      bounds.setLow(3, -2.01); bounds.setHigh(3, 2.01); //quaterion has to stay on the unit 4-ball, so its components max is 1, and min is -1
+      bounds.setLow(4, -2.01); bounds.setHigh(4, 2.01); //The .01 is like an epsilon.
+      bounds.setLow(5, -2.01); bounds.setHigh(5, 2.01);
+      bounds.setLow(6, -2.01); bounds.setHigh(6, 2.01);
       
-  
-    ompl::base::VehicleStateSpace *space = new ompl::base::VehicleStateSpace(17); 
-    ompl::base::RealVectorBounds bounds(17);
-    bounds.setLow(0, min_x); bounds.setHigh(0, max_x); //x
-    bounds.setLow(1, min_y); bounds.setHigh(1, max_y); //y
-    bounds.setLow(2, -100); bounds.setHigh(2, 100); //z
-    bounds.setLow(3, -2.01); bounds.setHigh(3, 2.01); //quaterion has to stay on the unit 4-ball, so its components max is 1, and min is -1
-    bounds.setLow(4, -2.01); bounds.setHigh(4, 2.01); //The .01 is like an epsilon.
-    bounds.setLow(5, -2.01); bounds.setHigh(5, 2.01);
-    bounds.setLow(6, -2.01); bounds.setHigh(6, 2.01);
-
-    for(unsigned i = 7; i < 17; i++){
-      bounds.setLow(i, -2000);
-      bounds.setHigh(i, 2000); //vx
-    }
-
-    space->setBounds(bounds);
-    space_ptr_ = ompl::base::StateSpacePtr(space);
+      for(unsigned i = 7; i < 17; i++){
+        bounds.setLow(i, -2000);
+        bounds.setHigh(i, 2000); //vx
+      }
+      
+      space->setBounds(bounds);
+      space_ptr_ = ompl::base::StateSpacePtr(space);
+    }
+    if(global_map_){
+      setMapBounds();
+    }
     //space_ptr_.reset(space); //no me gusta shared ptrs
     
     
@@ -197,7 +326,32 @@ namespace auvsl{
     
     si_ = ompl::control::SpaceInformationPtr(new ompl::control::SpaceInformation(space_ptr_, cspace_ptr));
     dynamic_model_ptr_ = ompl::control::StatePropagatorPtr(new JackalStatePropagator(si_));
-    si_->setStatePropagator(dynamic_model_ptr_);
+    
+    std::vector<std::string> primitive_fns;
+    nh.getParam("/MotionPrimitives/table_filenames", primitive_fns);
+    if(!primitive_fns.empty() && isModelStateSpace(space_ptr_.get())){
+      ROS_INFO("RRT Motion primitives work on the 17 double planner layout, not using them with the model state space");
+    }
+    else if(!primitive_fns.empty()){
+      primitives_ = new MotionPrimitiveLibrary();
+      for(unsigned i = 0; i < primitive_fns.size(); i++){
+        primitives_->load(primitive_fns[i].c_str());
+      }
+      primitives_->setTerrainMap(global_map_);
+      static_cast<JackalStatePropagator*>(dynamic_model_ptr_.get())->setMotionPrimitives(primitives_);
+    }
+    static_cast<JackalStatePropagator*>(dynamic_model_ptr_.get())->setModelValidityChecker(GlobalPlanner::isModelStateValid, GlobalParams::get_validity_check_interval());
+    if(GlobalParams::get_two_fidelity_planning() && isModelStateSpace(space_ptr_.get())){
+      ROS_INFO("RRT KinematicStatePropagator needs the 17 double planner layout, planning with full dynamics");
+      si_->setStatePropagator(dynamic_model_ptr_);
+    }
+    else if(GlobalParams::get_two_fidelity_planning()){
+      kinematic_model_ptr_ = ompl::control::StatePropagatorPtr(new KinematicStatePropagator(si_));
+      si_->setStatePropagator(kinematic_model_ptr_);
+    }
+    else{
+      si_->setStatePropagator(dynamic_model_ptr_);
+    }
     si_->setPropagationStepSize(GlobalParams::get_propagation_step_size());
     si_->setMinMaxControlDuration(5, 10);
     si_->setDirectedControlSamplerAllocator(allocCustomDirectedControlSampler);
@@ -222,6 +376,32 @@ namespace auvsl{
     ROS_INFO("RRT planner_ cleared");
   }
 
+  //x and y bounds of the state space follow whatever map is being planned on.
+  void GlobalPlanner::setMapBounds(){
+    float max_x, max_y, min_x, min_y;
+    global_map_->getBounds(max_x, min_x,  max_y, min_y);
+    ROS_INFO("RRT Bounds %f %f  %f %f", min_x, max_x, min_y, max_y);
+    
+    ompl::base::RealVectorBounds bounds = getSpaceBounds();
+    if(isModelStateSpace(space_ptr_.get())){
+      bounds.setLow(ompl::base::VehicleModelStateSpace::X, min_x); bounds.setHigh(ompl::base::VehicleModelStateSpace::X, max_x);
+      bounds.setLow(ompl::base::VehicleModelStateSpace::Y, min_y); bounds.setHigh(ompl::base::VehicleModelStateSpace::Y, max_y);
+      space_ptr_->as<ompl::base::VehicleModelStateSpace>()->setBounds(bounds);
+    }
+    else{
+      bounds.setLow(0, min_x); bounds.setHigh(0, max_x); //x
+      bounds.setLow(1, min_y); bounds.setHigh(1, max_y); //y
+      space_ptr_->as<ompl::base::VehicleStateSpace>()->setBounds(bounds);
+    }
+  }
+  
+  const ompl::base::RealVectorBounds& GlobalPlanner::getSpaceBounds(){
+    if(isModelStateSpace(space_ptr_.get())){
+      return space_ptr_->as<ompl::base::VehicleModelStateSpace>()->getBounds();
+    }
+    return space_ptr_->as<ompl::base::VehicleStateSpace>()->getBounds();
+  }
+  
   bool GlobalPlanner::makePlan(const geometry_msgs::PoseStamped& startp,
                                const geometry_msgs::PoseStamped& goalp,
                                std::vector<geometry_msgs::PoseStamped>& plan){
@@ -237,44 +417,97 @@ namespace auvsl{
     
     ROS_INFO("RRT makePlan started");
     ROS_INFO("Goalp frame %s", goalp.header.frame_id.c_str());
-    ompl::base::ScopedState<> start(space_ptr_);
+    double start_pose[7];
+    start_pose[0] = startp.pose.position.x;
+    start_pose[1] = startp.pose.position.y;
+    start_pose[2] = startp.pose.position.z;
     
-    start[0] = startp.pose.position.x;
-    start[1] = startp.pose.position.y;
-    start[2] = startp.pose.position.z;
-    
-    start[3] = startp.pose.orientation.x;
-    start[4] = startp.pose.orientation.y;
-    start[5] = startp.pose.orientation.z;
-    start[6] = startp.pose.orientation.w;
-
-    for(int i = 7; i < 17; i++){
-      start[i] = 0;
-    }
+    start_pose[3] = startp.pose.orientation.x;
+    start_pose[4] = startp.pose.orientation.y;
+    start_pose[5] = startp.pose.orientation.z;
+    start_pose[6] = startp.pose.orientation.w;
     
     RigidBodyDynamics::Math::Vector2d goal_pos(goalp.pose.position.x, goalp.pose.position.y);
     float goal_tol = .0001;
     
+    //Scans only go into the local map here, so it holds still while the tree is grown.
+    //The window has moved and seen new obstacles, the old tree is useless.
+    if(local_map_){
+      local_map_->update();
+      setMapBounds();
+      planner_->clear();
+    }
+    
+    //The server published a new map, same as switching sites.
+    if(shared_map_ && shared_map_->refresh()){
+      setMapBounds();
+      planner_->clear();
+    }
+    
+    if(catalog_){
+      const TerrainMap *site_map = catalog_->getMap(start_pose[0], start_pose[1], goal_pos[0], goal_pos[1]);
+      if(!site_map){
+        return false;
+      }
+      if(site_map != global_map_){ //switched sites, the old tree is useless
+        global_map_ = site_map;
+        setMapBounds();
+        if(primitives_){
+          primitives_->setTerrainMap(global_map_);
+        }
+        planner_->clear();
+      }
+    }
+    
+    //Cached results are only good on the map they came from. Any edit, new scan or site switch drops them.
+    PropagationCache *cache = static_cast<JackalStatePropagator*>(dynamic_model_ptr_.get())->getCache();
+    if(cache && (global_map_ != cache_map_ || global_map_->getRevision() != cache_revision_)){
+      cache->clear();
+      cache->setTerrainMap(global_map_);
+      cache_map_ = global_map_;
+      cache_revision_ = global_map_->getRevision();
+    }
+    
     // construct the state space we are planning in
     //    ompl::base::GoalPtr goal_ptr(new ompl::base::GoalSpace(si_));
     ompl::base::GoalSpace *goal = new ompl::base::GoalSpace(si_);
-    ompl::base::VehicleStateSpace *gspace = new ompl::base::VehicleStateSpace(17);
-    ompl::base::RealVectorBounds gbounds(17);
-    gbounds.setLow(0, goal_pos[0] - goal_tol);
-    gbounds.setHigh(0, goal_pos[0] + goal_tol);
-    gbounds.setLow(1, goal_pos[1] - goal_tol);
-    gbounds.setHigh(1, goal_pos[1] + goal_tol);
-    
-    for(int i = 2; i < 17; i++){ //Goal region is only in x and y. Unbounded in other state variables.
-      gbounds.setLow(i, -1000); gbounds.setHigh(i, 1000);
+    ompl::base::StateSpacePtr gspace_ptr;
+    if(isModelStateSpace(space_ptr_.get())){
+      //Goal space has to share the planner's layout, its bounds are checked against tree states.
+      ompl::base::VehicleModelStateSpace *gspace = new ompl::base::VehicleModelStateSpace();
+      ompl::base::RealVectorBounds gbounds(ompl::base::VehicleModelStateSpace::DIM);
+      for(unsigned i = 0; i < ompl::base::VehicleModelStateSpace::DIM; i++){
+        gbounds.setLow(i, -1000); gbounds.setHigh(i, 1000);
+      }
+      gbounds.setLow(ompl::base::VehicleModelStateSpace::X, goal_pos[0] - goal_tol);
+      gbounds.setHigh(ompl::base::VehicleModelStateSpace::X, goal_pos[0] + goal_tol);
+      gbounds.setLow(ompl::base::VehicleModelStateSpace::Y, goal_pos[1] - goal_tol);
+      gbounds.setHigh(ompl::base::VehicleModelStateSpace::Y, goal_pos[1] + goal_tol);
+      gspace->setBounds(gbounds);
+      gspace_ptr = ompl::base::StateSpacePtr(gspace);
+    }
+    else{
+      ompl::base::VehicleStateSpace *gspace = new ompl::base::VehicleStateSpace(17);
+      ompl::base::RealVectorBounds gbounds(17);
+      gbounds.setLow(0, goal_pos[0] - goal_tol);
+      gbounds.setHigh(0, goal_pos[0] + goal_tol);
+      gbounds.setLow(1, goal_pos[1] - goal_tol);
+      gbounds.setHigh(1, goal_pos[1] + goal_tol);
+      
+      for(int i = 2; i < 17; i++){ //Goal region is only in x and y. Unbounded in other state variables.
+        gbounds.setLow(i, -1000); gbounds.setHigh(i, 1000);
+      }
+      gspace->setBounds(gbounds);
+      gspace_ptr = ompl::base::StateSpacePtr(gspace);
     }
-    gspace->setBounds(gbounds);
-    ompl::base::StateSpacePtr gspace_ptr(gspace);
     
     goal->setSpace(gspace_ptr);
     ompl::base::GoalPtr goal_ptr(goal);
     
+    ompl::base::State *start = si_->allocState();
+    initVehicleState(space_ptr_.get(), start, start_pose);
     pdef_->addStartState(start);
+    si_->freeState(start);
     
     pdef_->setGoal(goal_ptr);
     planner_->setProblemDefinition(pdef_);
@@ -289,9 +522,79 @@ namespace auvsl{
     ROS_INFO("RRT started monitor");
     //float max_runtime = 600; //seconds
     float max_runtime = GlobalParams::get_max_gp_runtime();
+    ompl::time::point solve_start = ompl::time::now();
+    PropagationProfiler::Snapshot profile_start = PropagationProfiler::snapshot();
     ompl::base::PlannerTerminationCondition ptc = ompl::base::plannerOrTerminationCondition(ompl::base::timedPlannerTerminationCondition(max_runtime), ompl::base::exactSolnPlannerTerminationCondition(pdef_));
     ompl::base::PlannerStatus solved = planner_->solve(ptc);
     ROS_INFO("RRT Solved");
+    
+    //Kinematic path only counts once the full dynamics can actually drive it.
+    //The tracked states replace the kinematic ones. Where tracking fails, only that stretch is
+    //replanned with the dynamics, from the last tracked state to wherever it can rejoin the
+    //kinematic path, and tracking carries on from there.
+    std::vector<ompl::base::State*> tracked;
+    if(solved && kinematic_model_ptr_){
+      ompl::control::PathControl *kin_path = pdef_->getSolutions()[0].path_->as<ompl::control::PathControl>();
+      const std::vector<ompl::base::State*> &kin_states = kin_path->getStates();
+      ompl::control::VehicleRRT *rrt_planner = planner_->as<ompl::control::VehicleRRT>();
+      double tolerance = GlobalParams::get_verify_tolerance();
+      unsigned reached = rrt_planner->trackPath(kin_states, 1, dynamic_model_ptr_, tolerance, tracked);
+      ROS_INFO("RRT Dynamic verification reached %u of %lu kinematic path states", reached, kin_states.size());
+      
+      si_->setStatePropagator(dynamic_model_ptr_);
+      while(reached < kin_states.size()){
+        float remaining = max_runtime - ompl::time::seconds(ompl::time::now() - solve_start);
+        if(remaining <= 0){
+          break;
+        }
+        ROS_INFO("RRT Repairing the kinematic path from state %u with full dynamics, %f seconds left", reached, remaining);
+        
+        ompl::base::ProblemDefinitionPtr repair_pdef(new ompl::base::ProblemDefinition(si_));
+        repair_pdef->addStartState(tracked.back());
+        PathRejoinGoal *rejoin = new PathRejoinGoal(si_, kin_states, reached, tolerance);
+        repair_pdef->setGoal(ompl::base::GoalPtr(rejoin));
+        planner_->clear();
+        planner_->setProblemDefinition(repair_pdef);
+        ompl::base::PlannerTerminationCondition repair_ptc = ompl::base::plannerOrTerminationCondition(ompl::base::timedPlannerTerminationCondition(remaining), ompl::base::exactSolnPlannerTerminationCondition(repair_pdef));
+        planner_->solve(repair_ptc);
+        if(!repair_pdef->hasExactSolution()){
+          break;
+        }
+        
+        //First repair state is tracked.back() itself.
+        const std::vector<ompl::base::State*> &repair_states = repair_pdef->getSolutions()[0].path_->as<ompl::control::PathControl>()->getStates();
+        for(unsigned i = 1; i < repair_states.size(); i++){
+          ompl::base::State *state = si_->allocState();
+          si_->copyState(state, repair_states[i]);
+          tracked.push_back(state);
+        }
+        
+        unsigned rejoin_idx = rejoin->getRejoinIndex(tracked.back());
+        if(rejoin_idx == kin_states.size()-1){ //within tolerance of the end, same as tracking it
+          reached = kin_states.size();
+          break;
+        }
+        reached = rrt_planner->trackPath(kin_states, rejoin_idx+1, dynamic_model_ptr_, tolerance, tracked);
+        ROS_INFO("RRT Rejoined at kinematic path state %u, tracking reached %u", rejoin_idx, reached);
+      }
+      si_->setStatePropagator(kinematic_model_ptr_);
+      planner_->clear();
+      planner_->setProblemDefinition(pdef_);
+      
+      if(reached < kin_states.size()){
+        ROS_INFO("RRT Kinematic path could not be repaired in time");
+        for(unsigned i = 0; i < tracked.size(); i++){
+          si_->freeState(tracked[i]);
+        }
+        tracked.clear();
+        solved = ompl::base::PlannerStatus::TIMEOUT;
+      }
+    }
+    ROS_INFO("RRT propagate calls %lu   solver allocs %lu   solver inits %lu", JackalStatePropagator::getNumPropagateCalls(), JackalStatePropagator::getNumSolverAllocs(), JackalStatePropagator::getNumSolverInits());
+    ROS_INFO("RRT solver steps %lu   rejected adaptive steps %lu", JackalStatePropagator::getNumSolverSteps(), JackalStatePropagator::getNumRejectedSteps());
+    ROS_INFO("RRT motion primitive hits %lu   early exits %lu", JackalStatePropagator::getNumPrimitiveHits(), JackalStatePropagator::getNumEarlyExits());
+    PropagationProfiler::printSnapshot(PropagationProfiler::difference(PropagationProfiler::snapshot(), profile_start),
+                                       ompl::time::seconds(ompl::time::now() - solve_start));
 
     planner_visualizer.stopMonitor();
     
@@ -303,19 +606,31 @@ namespace auvsl{
         
       ompl::control::PathControl *path = soln.path_->as<ompl::control::PathControl>();
         
-      std::vector<ompl::base::State*> states = path->getStates();
-      std::vector<ompl::control::Control*> controls = path->getControls();
-      std::vector<double> durations = path->getControlDurations();
-        
-      unsigned num_waypoints;
-      getWaypoints(controls, durations, states, plan, num_waypoints);
+      if(!tracked.empty()){
+        statesToWaypoints(tracked, plan);
+        for(unsigned i = 0; i < tracked.size(); i++){
+          si_->freeState(tracked[i]);
+        }
+      }
+      else{
+        statesToWaypoints(path->getStates(), plan);
+      }
+      
+      PropagationCache *cache = static_cast<JackalStatePropagator*>(dynamic_model_ptr_.get())->getCache();
+      if(cache){
+        cache->printStats();
+      }
       ROS_INFO("RRT Returning true from makePlan");
       
-      delete global_map_;
+      if(!catalog_ && !shared_map_ && !local_map_){
+        delete global_map_;
+      }
       return true;
     }
     else{
-      delete global_map_;
+      if(!catalog_ && !shared_map_ && !local_map_){
+        delete global_map_;
+      }
       return false;
     }
     
@@ -1,15 +1,38 @@
 #include <ros/ros.h>
 #include <geometry_msgs/Pose.h>
 #include "JackalStatePropagator.h"
+#include "GlobalParams.h"
+#include "VehicleModelStateSpace.h"
+#include "ControlSystem.h"
 #include <stdio.h>
-
+#include <string.h>
+#include <memory>
+#include <math.h>
+#include <algorithm>
 
 
 JackalStatePropagator::JackalStatePropagator(ompl::control::SpaceInformationPtr si) : StatePropagator(si){
       ROS_INFO("Jackal state prop constructor\n");
+      pool_ = new ThreadPool(GlobalParams::get_num_threads());
+      primitives_ = NULL;
+      check_interval_ = 1;
+      model_space_ = auvsl::isModelStateSpace(si->getStateSpace().get());
+      
+      ros::NodeHandle nh;
+      int cache_capacity = 0;
+      nh.getParam("/PropagationCache/capacity", cache_capacity);
+      cache_ = NULL;
+      if(cache_capacity > 0 && model_space_){
+        ROS_INFO("PropagationCache works on the 17 double planner layout, not using it with the model state space");
+      }
+      else if(cache_capacity > 0){
+        cache_ = new PropagationCache(cache_capacity);
+      }
 }
 
 JackalStatePropagator::~JackalStatePropagator(){
+  delete pool_;
+  delete cache_;
 }
 
 
@@ -73,37 +96,227 @@ void JackalStatePropagator::convert_to_planner_space(double *planner_state, cons
 
 
 
+//Building a HybridDynamics sets up the whole vehicle model, so each thread builds
+//one the first time it propagates and keeps it. Every propagate re-runs initState
+//with its start state, which is cheap next to construction, so whatever initState
+//sets up besides state_ doesn't carry over from the last call either.
+HybridDynamics& JackalStatePropagator::getThreadSolver(){
+  thread_local std::unique_ptr<HybridDynamics> solver;
+  if(!solver){
+    PropagationProfiler::Counters &prof = PropagationProfiler::local();
+    solver.reset(new HybridDynamics());
+    prof.add(prof.solver_allocs, 1ul);
+    
+    float x_init[21] = {0};
+    x_init[3] = 1; //identity quaternion
+    solver->initState(x_init);
+    prof.add(prof.solver_inits, 1ul);
+  }
+  return *solver;
+}
+
 void JackalStatePropagator::propagate(const ompl::base::State *state, const ompl::control::Control *control, double duration, ompl::base::State *result) const{
-  const double* val = state->as<ompl::base::RealVectorStateSpace::StateType>()->values;
-  double* result_val = result->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+  propagateSteps(state, control, duration, result);
+}
+
+void JackalStatePropagator::propagateBatch(const std::vector<const ompl::base::State*> &states, const std::vector<const ompl::control::Control*> &controls,
+                                           const std::vector<double> &durations, const std::vector<ompl::base::State*> &results,
+                                           std::vector<unsigned> &steps, std::vector<int> &valid) const{
+  steps.resize(states.size());
+  valid.resize(states.size());
   
-  const double *control_vector = control->as<ompl::control::RealVectorControlSpace::ControlType>()->values;
+  //Workers are persistent threads, so each one keeps its own solver from getThreadSolver.
+  pool_->parallelFor(states.size(), [&](unsigned i, unsigned worker){
+    steps[i] = propagateSteps(states[i], controls[i], durations[i], results[i]);
+    valid[i] = si_->isValid(results[i]);
+    PropagationProfiler::Counters &prof = PropagationProfiler::local(); //counted, not timed, the call already ended
+    prof.add(prof.validity_checks, 1ul);
+  });
+}
+
+//Step doubling. Each macro step advances 2h twice, once as one 2h step and once as
+//two h steps, and is kept when the two agree on every pose component within
+//integration_tolerance + integration_rel_tolerance*|component|. Only the pose is
+//compared, velocities and wheel angles are much bigger numbers and would decide
+//every step. h doubles when the error is under a quarter of that and halves on a
+//rejection. A macro step costs three solves, which only pays off above h = 1 base
+//step, so at the bottom plain base steps are taken and doubling is tried again after
+//a backoff that doubles with every rejection in a row. Time is counted in whole base
+//steps so the same total time as the fixed loop is covered.
+//remaining is the base steps left in the whole trajectory. Integrates at least min_steps
+//of them and stops at the first macro step boundary after, so callers checking validity
+//in chunks check at macro step boundaries and macro steps are sized by the whole
+//trajectory, not the chunk. step carries h from one call to the next.
+//Returns the number of solver steps taken, rejected ones included.
+unsigned JackalStatePropagator::integrateAdaptive(HybridDynamics &solver, float vl, float vr, int &remaining, int min_steps, AdaptiveStep &step){
+  const float base_step = solver.stepsize;
+  const float abs_tolerance = GlobalParams::get_integration_tolerance();
+  const float rel_tolerance = GlobalParams::get_integration_rel_tolerance();
+  const int max_scale = std::max(1, GlobalParams::get_max_step_scale());
   
-  float x_start[21];
-  float x_end[21];
+  PropagationProfiler::Counters &prof = PropagationProfiler::local();
+  const int stop_at = std::max(remaining - min_steps, 0);
+  int &scale = step.scale;
+  scale = std::min(scale, max_scale);
+  unsigned num_steps = 0;
   
-  HybridDynamics solver;
-  solver.initState((float *) x_start);
+  float x_start[21];
+  float x_big[21];
   
-  convert_to_model_space(val, x_start);
-  for(int i = 0; i < solver.STATE_DIM; i++){
-    solver.state_[i] = x_start[i];
+  while(remaining > stop_at){
+    while(scale > 2 && (2*scale) > remaining){
+      scale /= 2;
+    }
+    
+    if(scale == 1 || (2*scale) > remaining){
+      solver.stepsize = base_step;
+      solver.step(vl, vr);
+      num_steps++;
+      remaining--;
+      if(scale == 1 && --step.plain_left <= 0 && max_scale > 1){
+        scale = 2;
+      }
+      continue;
+    }
+    
+    for(int i = 0; i < solver.STATE_DIM; i++){
+      x_start[i] = solver.state_[i];
+    }
+    
+    solver.stepsize = 2*scale*base_step;
+    solver.step(vl, vr);
+    for(int i = 0; i < solver.STATE_DIM; i++){
+      x_big[i] = solver.state_[i];
+      solver.state_[i] = x_start[i];
+    }
+    
+    solver.stepsize = scale*base_step;
+    solver.step(vl, vr);
+    solver.step(vl, vr);
+    num_steps += 3;
+    
+    //Quaternion 0-3 and position 4-6. Error is in units of the allowed error.
+    float err = 0;
+    for(int i = 0; i < 7; i++){
+      float allowed = abs_tolerance + rel_tolerance*std::max(fabsf(solver.state_[i]), fabsf(x_big[i]));
+      err = std::max(err, fabsf(solver.state_[i] - x_big[i]) / std::max(allowed, 1e-9f));
+    }
+    
+    if(err <= 1){
+      remaining -= 2*scale;
+      step.backoff = 2;
+      if(err < .25f && scale < max_scale){
+        scale *= 2;
+      }
+    }
+    else{
+      for(int i = 0; i < solver.STATE_DIM; i++){
+        solver.state_[i] = x_start[i];
+      }
+      scale /= 2;
+      if(scale == 1){
+        step.plain_left = step.backoff;
+        step.backoff = std::min(2*step.backoff, 64);
+      }
+      prof.add(prof.rejected_steps, 3ul);
+    }
   }
   
+  solver.stepsize = base_step;
+  return num_steps;
+}
+
+void JackalStatePropagator::controlToWheels(const double *control_vector, float &vl, float &vr){
   float Vf = control_vector[1];//GlobalParams::get_fuzzy_constant_speed();
   float Wz = control_vector[0];
   float base_width = 2*Jackal::rcg::tx_front_left_wheel;
-  float vl = (Vf - Wz*(base_width/2.0))/Jackal::rcg::tire_radius;
-  float vr = (Vf + Wz*(base_width/2.0))/Jackal::rcg::tire_radius;
+  vl = (Vf - Wz*(base_width/2.0))/Jackal::rcg::tire_radius;
+  vr = (Vf + Wz*(base_width/2.0))/Jackal::rcg::tire_radius;
+}
+
+//With VehicleModelStateSpace the state already is the solver's layout and is just copied.
+void JackalStatePropagator::readModelState(const ompl::base::State *state, float *model_state) const{
+  PropagationProfiler::Counters &prof = PropagationProfiler::local();
+  prof.add(prof.conversions, 1ul);
+  if(model_space_){
+    memcpy(model_state, state->as<ompl::base::VehicleModelStateSpace::StateType>()->values, sizeof(float)*ompl::base::VehicleModelStateSpace::DIM);
+  }
+  else{
+    convert_to_model_space(state->as<ompl::base::RealVectorStateSpace::StateType>()->values, model_state);
+  }
+}
+
+void JackalStatePropagator::writeModelState(const float *model_state, ompl::base::State *state) const{
+  PropagationProfiler::Counters &prof = PropagationProfiler::local();
+  prof.add(prof.conversions, 1ul);
+  if(model_space_){
+    float *values = state->as<ompl::base::VehicleModelStateSpace::StateType>()->values;
+    memcpy(values, model_state, sizeof(float)*ompl::base::VehicleModelStateSpace::DIM);
+    for(int i = 7; i < 11; i++){ //wheel angles grow without bound, the 17 double layout never kept them either
+      values[i] = 0;
+    }
+  }
+  else{
+    convert_to_planner_space(state->as<ompl::base::RealVectorStateSpace::StateType>()->values, model_state);
+  }
+}
+
+//Returns the number of solver steps taken.
+unsigned JackalStatePropagator::propagateSteps(const ompl::base::State *state, const ompl::control::Control *control, double duration, ompl::base::State *result) const{
+  const double *control_vector = control->as<ompl::control::RealVectorControlSpace::ControlType>()->values;
+  
+  float x_start[21];
+  float x_end[21];
+  
+  PropagationProfiler::Counters &prof = PropagationProfiler::local();
+  prof.startCall();
+  
+  //Primitives and the cache both work on the planner layout.
+  const double* val = NULL;
+  double* result_val = NULL;
+  if(!model_space_){
+    val = state->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+    result_val = result->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+    
+    if(primitives_ && primitives_->apply(val, control_vector[0], control_vector[1], duration, result_val)){
+      prof.add(prof.primitive_hits, 1ul);
+      prof.endCall();
+      return 0;
+    }
+    if(cache_ && val != result_val && cache_->lookup(val, control_vector, duration, result_val)){
+      prof.endCall();
+      return 0;
+    }
+  }
+  
+  HybridDynamics &solver = getThreadSolver();
+  
+  readModelState(state, x_start);
+  solver.initState(x_start);
+  prof.add(prof.solver_inits, 1ul);
   
+  float vl, vr;
+  controlToWheels(control_vector, vl, vr);
   
   //ROS_INFO("Solver control: <%f %f>", control_vector[0], control_vector[1]);
   //ROS_INFO("Solver start: <%f %f>     control: <%f %f>     <%f %f>", x_start[0], x_start[1],   control_vector[0], control_vector[1],   vl, vr);
   //ROS_INFO("Duration %f", duration);
   
-  for(int i = 0; (i*solver.stepsize) < duration; i++){
-    solver.step(vl, vr);
+  unsigned num_steps = 0;
+  uint64_t integration_start = prof.tick();
+  if(GlobalParams::get_adaptive_integration()){
+    int remaining = (int) ceil(duration / solver.stepsize);
+    AdaptiveStep step;
+    num_steps = integrateAdaptive(solver, vl, vr, remaining, remaining, step);
+  }
+  else{
+    for(int i = 0; (i*solver.stepsize) < duration; i++){
+      solver.step(vl, vr);
+      num_steps++;
+    }
   }
+  prof.addTicks(prof.integration_ticks, integration_start);
+  prof.add(prof.solver_steps, (unsigned long) num_steps);
   
   //ROS_INFO("Solver end: <%f %f>\n", x_end[0], x_end[1]);
   
@@ -112,7 +325,247 @@ void JackalStatePropagator::propagate(const ompl::base::State *state, const ompl
     x_end[i] = solver.state_[i];
   }
   
-  convert_to_planner_space(result_val, x_end);
+  writeModelState(x_end, result);
+  if(cache_ && val != result_val){ //in place propagation already overwrote the start
+    cache_->insert(val, control_vector, duration, result_val);
+  }
+  prof.endCall();
+  return num_steps;
+}
+
+
+
+//Integrates in chunks of check_interval_ base steps and checks the model state between chunks.
+//Primitives and the cache only know full duration results, so they are tried first. A hit
+//whose end passes the checker is the answer, otherwise the chunked integration finds where
+//the motion goes invalid.
+bool JackalStatePropagator::propagateUntilInvalid(const ompl::base::State *state, const ompl::control::Control *control, double duration,
+                                                  ompl::base::State *result, double &valid_duration) const{
+  if(!model_validity_checker_){
+    propagateSteps(state, control, duration, result);
+    valid_duration = duration;
+    return true;
+  }
+  
+  const double *control_vector = control->as<ompl::control::RealVectorControlSpace::ControlType>()->values;
+  
+  float x_current[21];
+  float x_valid[21];
+  
+  PropagationProfiler::Counters &prof = PropagationProfiler::local();
+  prof.startCall();
+  
+  //Primitives and the cache both work on the planner layout. In place, a hit that fails
+  //the check would already have overwritten the start, so they are skipped.
+  const double* val = NULL;
+  double* result_val = NULL;
+  if(!model_space_ && state != result){
+    val = state->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+    result_val = result->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+    
+    bool hit = false;
+    if(primitives_ && primitives_->apply(val, control_vector[0], control_vector[1], duration, result_val)){
+      prof.add(prof.primitive_hits, 1ul);
+      hit = true;
+    }
+    else if(cache_ && cache_->lookup(val, control_vector, duration, result_val)){
+      hit = true;
+    }
+    
+    if(hit){
+      readModelState(result, x_current);
+      uint64_t validity_start = prof.tick();
+      bool hit_valid = model_validity_checker_(x_current);
+      prof.addTicks(prof.validity_ticks, validity_start);
+      prof.add(prof.validity_checks, 1ul);
+      if(hit_valid){
+        valid_duration = duration;
+        prof.endCall();
+        return true;
+      }
+    }
+  }
+  
+  HybridDynamics &solver = getThreadSolver();
+  
+  readModelState(state, x_valid);
+  solver.initState(x_valid);
+  prof.add(prof.solver_inits, 1ul);
+  
+  float vl, vr;
+  controlToWheels(control_vector, vl, vr);
+  
+  const float base_step = solver.stepsize;
+  const int total_steps = (int) ceil(duration / base_step);
+  const bool adaptive = GlobalParams::get_adaptive_integration();
+  
+  AdaptiveStep step;
+  unsigned num_steps = 0;
+  int remaining = total_steps;
+  int valid_steps = 0;
+  bool is_valid = true;
+  while(remaining > 0){
+    uint64_t integration_start = prof.tick();
+    if(adaptive){
+      num_steps += integrateAdaptive(solver, vl, vr, remaining, (int) check_interval_, step);
+    }
+    else{
+      int chunk = std::min((int) check_interval_, remaining);
+      for(int i = 0; i < chunk; i++){
+        solver.step(vl, vr);
+      }
+      num_steps += chunk;
+      remaining -= chunk;
+    }
+    prof.addTicks(prof.integration_ticks, integration_start);
+    
+    for(int i = 0; i < solver.STATE_DIM; i++){
+      x_current[i] = solver.state_[i];
+    }
+    uint64_t validity_start = prof.tick();
+    bool chunk_valid = model_validity_checker_(x_current);
+    prof.addTicks(prof.validity_ticks, validity_start);
+    prof.add(prof.validity_checks, 1ul);
+    if(!chunk_valid){
+      is_valid = false;
+      break;
+    }
+    
+    for(int i = 0; i < solver.STATE_DIM; i++){
+      x_valid[i] = x_current[i];
+    }
+    valid_steps = total_steps - remaining;
+  }
+  prof.add(prof.solver_steps, (unsigned long) num_steps);
+  
+  writeModelState(x_valid, result);
+  if(is_valid){
+    valid_duration = duration;
+    if(cache_ && val){ //only whole durations are cached
+      cache_->insert(val, control_vector, duration, result_val);
+    }
+  }
+  else{
+    valid_duration = valid_steps*base_step;
+    prof.add(prof.early_exits, 1ul);
+  }
+  prof.endCall();
+  return is_valid;
+}
+
+
+
+//The controller runs between steps and the solver state carries straight over, so a step
+//costs one control law evaluation and the integration, nothing is allocated.
+//Each step starts the way propagate would from the stored state: wheel angles zeroed and a
+//fresh adaptive step, so propagate on a kept state and control reproduces the next one.
+//The model checker runs between chunks, and the end of every step gets the full si_->isValid
+//check, same as controlWhileValid.
+unsigned JackalStatePropagator::rollout(const ompl::base::State *start, double goal_x, double goal_y, unsigned max_steps, double step_duration, Rollout &rollout) const{
+  const unsigned dim = ompl::base::VehicleModelStateSpace::DIM;
+  if(rollout.states.size() < max_steps*dim){
+    rollout.states.resize(max_steps*dim);
+    rollout.controls.resize(max_steps*2);
+  }
+  rollout.size = 0;
+  
+  PropagationProfiler::Counters &prof = PropagationProfiler::local();
+  HybridDynamics &solver = getThreadSolver();
+  
+  float x_start[21];
+  readModelState(start, x_start);
+  solver.initState(x_start);
+  prof.add(prof.solver_inits, 1ul);
+  
+  const float base_step = solver.stepsize;
+  const int total_steps = (int) ceil(step_duration / base_step);
+  const int check_interval = model_validity_checker_ ? (int) check_interval_ : total_steps;
+  const bool adaptive = GlobalParams::get_adaptive_integration();
+  
+  ompl::base::State *scratch = si_->allocState();
+  
+  double control_vector[2];
+  float quat[4];
+  float v_forward, v_angular, vl, vr;
+  bool is_valid = true;
+  while(is_valid && rollout.size < max_steps){
+    prof.startCall();
+    float *x_end = &rollout.states[rollout.size*dim];
+    
+    for(int i = 7; i < 11; i++){ //stored states never keep the wheel angles, see writeModelState
+      solver.state_[i] = 0;
+    }
+    
+    for(int i = 0; i < 4; i++){
+      quat[i] = solver.state_[i];
+    }
+    auvsl::SimpleControlSystem::computeCommand(solver.state_[4], solver.state_[5], quat, goal_x, goal_y, v_forward, v_angular);
+    control_vector[0] = v_angular;
+    control_vector[1] = v_forward;
+    controlToWheels(control_vector, vl, vr);
+    
+    AdaptiveStep step;
+    unsigned num_steps = 0;
+    int remaining = total_steps;
+    while(remaining > 0){
+      uint64_t integration_start = prof.tick();
+      if(adaptive){
+        num_steps += integrateAdaptive(solver, vl, vr, remaining, check_interval, step);
+      }
+      else{
+        int chunk = std::min(check_interval, remaining);
+        for(int i = 0; i < chunk; i++){
+          solver.step(vl, vr);
+        }
+        num_steps += chunk;
+        remaining -= chunk;
+      }
+      prof.addTicks(prof.integration_ticks, integration_start);
+      
+      if(model_validity_checker_){
+        for(int i = 0; i < solver.STATE_DIM; i++){
+          x_end[i] = solver.state_[i];
+        }
+        uint64_t validity_start = prof.tick();
+        is_valid = model_validity_checker_(x_end);
+        prof.addTicks(prof.validity_ticks, validity_start);
+        prof.add(prof.validity_checks, 1ul);
+        if(!is_valid){
+          prof.add(prof.early_exits, 1ul);
+          break;
+        }
+      }
+    }
+    prof.add(prof.solver_steps, (unsigned long) num_steps);
+    
+    if(is_valid){
+      for(int i = 0; i < solver.STATE_DIM; i++){
+        x_end[i] = solver.state_[i];
+      }
+      writeModelState(x_end, scratch);
+      uint64_t validity_start = prof.tick();
+      is_valid = si_->isValid(scratch);
+      prof.addTicks(prof.validity_ticks, validity_start);
+      prof.add(prof.validity_checks, 1ul);
+    }
+    
+    if(is_valid){
+      rollout.controls[2*rollout.size] = control_vector[0];
+      rollout.controls[(2*rollout.size) + 1] = control_vector[1];
+      rollout.size++;
+    }
+    prof.endCall();
+  }
+  
+  si_->freeState(scratch);
+  return rollout.size;
+}
+
+void JackalStatePropagator::getRolloutStep(const Rollout &rollout, unsigned i, ompl::base::State *state, ompl::control::Control *control) const{
+  writeModelState(&rollout.states[i*ompl::base::VehicleModelStateSpace::DIM], state);
+  double *control_vector = control->as<ompl::control::RealVectorControlSpace::ControlType>()->values;
+  control_vector[0] = rollout.controls[2*i];
+  control_vector[1] = rollout.controls[(2*i) + 1];
 }
 
 
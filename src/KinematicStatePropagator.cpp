@@ -0,0 +1,72 @@
+#include <ros/ros.h>
+#include "KinematicStatePropagator.h"
+#include "GlobalParams.h"
+#include <math.h>
+
+
+
+KinematicStatePropagator::KinematicStatePropagator(ompl::control::SpaceInformationPtr si) : StatePropagator(si){
+  turn_efficiency_ = GlobalParams::get_kinematic_turn_efficiency();
+  slip_ = GlobalParams::get_kinematic_slip();
+  ROS_INFO("Kinematic state prop constructor. turn efficiency %f   slip %f", turn_efficiency_, slip_);
+}
+
+KinematicStatePropagator::~KinematicStatePropagator(){
+}
+
+//Same control and state layout as JackalStatePropagator. control is <Wz, Vf>.
+void KinematicStatePropagator::propagate(const ompl::base::State *state, const ompl::control::Control *control, double duration, ompl::base::State *result) const{
+  const double* val = state->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+  double* result_val = result->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+  const double *control_vector = control->as<ompl::control::RealVectorControlSpace::ControlType>()->values;
+  
+  double qx = val[3];
+  double qy = val[4];
+  double qz = val[5];
+  double qw = val[6];
+  double yaw = atan2(2*((qw*qz) + (qx*qy)), 1 - 2*((qy*qy) + (qz*qz)));
+  
+  double Wz = control_vector[0]*turn_efficiency_;
+  double Vf = control_vector[1]*(1 - slip_);
+  
+  double x = val[0];
+  double y = val[1];
+  double new_yaw = yaw + (Wz*duration);
+  if(fabs(Wz) < 1e-6){
+    x += Vf*cos(yaw)*duration;
+    y += Vf*sin(yaw)*duration;
+  }
+  else{
+    x += (Vf/Wz)*(sin(new_yaw) - sin(yaw));
+    y -= (Vf/Wz)*(cos(new_yaw) - cos(yaw));
+  }
+  
+  result_val[0] = x;
+  result_val[1] = y;
+  result_val[2] = val[2];
+  
+  result_val[3] = 0;
+  result_val[4] = 0;
+  result_val[5] = sin(.5*new_yaw);
+  result_val[6] = cos(.5*new_yaw);
+  
+  result_val[7] = Vf*cos(new_yaw); //vx
+  result_val[8] = Vf*sin(new_yaw); //vy
+  result_val[9] = 0;
+  
+  result_val[10] = 0;
+  result_val[11] = 0;
+  result_val[12] = Wz;
+  
+  for(int i = 13; i < 17; i++){ //wheel speeds aren't modeled
+    result_val[i] = 0;
+  }
+}
+
+bool KinematicStatePropagator::canPropagateBackward() const{
+  return false;
+}
+
+bool KinematicStatePropagator::canSteer() const{
+  return false;
+}
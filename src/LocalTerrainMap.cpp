@@ -0,0 +1,258 @@
+#include "LocalTerrainMap.h"
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl_conversions/pcl_conversions.h>
+#include <tf2_sensor_msgs/tf2_sensor_msgs.h>
+
+#include <math.h>
+#include <cmath>
+#include <stdlib.h>
+#include <algorithm>
+
+
+
+LocalTerrainMap::LocalTerrainMap(){
+  private_nh_ = new ros::NodeHandle("~/local_terrain_map");
+  private_nh_->setCallbackQueue(&queue_);
+
+  int size = 200;
+  std::string cloud_topic;
+  map_res_ = .1f;
+  obstacle_height_ = .3f;
+  max_height_ = 1;
+  robot_z_ = 0;
+  map_frame_ = "map";
+  base_frame_ = "base_link";
+
+  private_nh_->getParam("/LocalMap/size", size);
+  private_nh_->getParam("/LocalMap/resolution", map_res_);
+  private_nh_->getParam("/LocalMap/obstacle_height", obstacle_height_);
+  private_nh_->getParam("/LocalMap/max_height", max_height_);
+  private_nh_->getParam("/LocalMap/cloud_topic", cloud_topic);
+  private_nh_->getParam("/LocalMap/map_frame", map_frame_);
+  private_nh_->getParam("/LocalMap/base_frame", base_frame_);
+
+  size_ = size;
+  ground_z_ = new float[size_*size_];
+  max_z_ = new float[size_*size_];
+  scan_id_ = new unsigned[size_*size_];
+  current_scan_ = 0;
+  revision_ = 0;
+
+  for(unsigned i = 0; i < size_*size_; i++){
+    clearCell(i);
+  }
+
+  origin_col_ = -(int)(size_/2);
+  origin_row_ = -(int)(size_/2);
+
+  //The listener has its own spinner thread, so transforms keep arriving between updates.
+  tf_buffer_ = new tf2_ros::Buffer();
+  tf_listener_ = new tf2_ros::TransformListener(*tf_buffer_);
+  
+  if(!cloud_topic.empty()){
+    cloud_sub_ = private_nh_->subscribe(cloud_topic, 1, &LocalTerrainMap::cloudCallback, this);
+  }
+
+  ROS_INFO("Local terrain map %u x %u cells at %f m", size_, size_, map_res_);
+}
+
+LocalTerrainMap::~LocalTerrainMap(){
+  cloud_sub_.shutdown();
+  delete tf_listener_;
+  delete tf_buffer_;
+  delete private_nh_;
+  delete[] ground_z_;
+  delete[] max_z_;
+  delete[] scan_id_;
+}
+
+void LocalTerrainMap::clearCell(unsigned idx){
+  ground_z_[idx] = 0;
+  max_z_[idx] = 0;
+  scan_id_[idx] = 0; //0 means never observed
+}
+
+int LocalTerrainMap::worldToCell(float x, float y, int &world_row, int &world_col) const{
+  world_col = (int) floorf(x / map_res_);
+  world_row = (int) floorf(y / map_res_);
+
+  return (world_col >= origin_col_) && (world_col < (origin_col_ + (int)size_)) &&
+         (world_row >= origin_row_) && (world_row < (origin_row_ + (int)size_));
+}
+
+//Scrolls the window so (x,y) is in the middle.
+//Only the rows and columns that wrap around to the other side get cleared.
+void LocalTerrainMap::setCenter(float x, float y){
+  int new_col = (int) floorf(x / map_res_) - (int)(size_/2);
+  int new_row = (int) floorf(y / map_res_) - (int)(size_/2);
+
+  int d_col = new_col - origin_col_;
+  int d_row = new_row - origin_row_;
+
+  if(abs(d_col) >= (int)size_ || abs(d_row) >= (int)size_){
+    for(unsigned i = 0; i < size_*size_; i++){
+      clearCell(i);
+    }
+  }
+  else{
+    int col_begin = (d_col > 0) ? origin_col_ : (new_col + size_);
+    int col_end = (d_col > 0) ? new_col : (origin_col_ + size_);
+    for(int c = col_begin; c < col_end; c++){
+      unsigned wc = wrap(c);
+      for(unsigned r = 0; r < size_; r++){
+        clearCell((r*size_) + wc);
+      }
+    }
+
+    int row_begin = (d_row > 0) ? origin_row_ : (new_row + size_);
+    int row_end = (d_row > 0) ? new_row : (origin_row_ + size_);
+    for(int r = row_begin; r < row_end; r++){
+      unsigned offset = wrap(r)*size_;
+      for(unsigned c = 0; c < size_; c++){
+        clearCell(offset + c);
+      }
+    }
+  }
+
+  origin_col_ = new_col;
+  origin_row_ = new_row;
+  revision_++;
+}
+
+void LocalTerrainMap::update(){
+  queue_.callAvailable();
+}
+
+//Scans come in the sensor frame. The window follows the robot at the time of the scan.
+void LocalTerrainMap::cloudCallback(const sensor_msgs::PointCloud2ConstPtr& msg){
+  geometry_msgs::TransformStamped robot_tf;
+  geometry_msgs::TransformStamped cloud_tf;
+  try{
+    robot_tf = tf_buffer_->lookupTransform(map_frame_, base_frame_, msg->header.stamp, ros::Duration(.1));
+    cloud_tf = tf_buffer_->lookupTransform(map_frame_, msg->header.frame_id, msg->header.stamp, ros::Duration(.1));
+  }
+  catch(tf2::TransformException &ex){
+    ROS_INFO("LocalTerrainMap dropping scan: %s", ex.what());
+    return;
+  }
+  
+  setCenter(robot_tf.transform.translation.x, robot_tf.transform.translation.y);
+  robot_z_ = robot_tf.transform.translation.z;
+  
+  sensor_msgs::PointCloud2 map_cloud;
+  tf2::doTransform(*msg, map_cloud, cloud_tf);
+  insertCloud(map_cloud);
+}
+
+//Any cell hit by this scan forgets what older scans put there.
+void LocalTerrainMap::insertCloud(const sensor_msgs::PointCloud2 &msg){
+  pcl::PointCloud<pcl::PointXYZ> cloud;
+  pcl::fromROSMsg(msg, cloud);
+
+  current_scan_++;
+  if(current_scan_ == 0){ //wrapped around. Don't want scans to look unobserved.
+    current_scan_ = 1;
+  }
+  revision_++;
+
+  int world_row;
+  int world_col;
+  for(unsigned i = 0; i < cloud.points.size(); i++){
+    const pcl::PointXYZ &pt = cloud.points[i];
+    if(!std::isfinite(pt.x) || !std::isfinite(pt.y) || !std::isfinite(pt.z) || pt.z > (robot_z_ + max_height_)){
+      continue;
+    }
+    if(!worldToCell(pt.x, pt.y, world_row, world_col)){
+      continue;
+    }
+
+    unsigned idx = cellIndex(world_row, world_col);
+    if(scan_id_[idx] != current_scan_){
+      ground_z_[idx] = pt.z;
+      max_z_[idx] = pt.z;
+      scan_id_[idx] = current_scan_;
+    }
+    else{
+      ground_z_[idx] = std::min(ground_z_[idx], pt.z);
+      max_z_[idx] = std::max(max_z_[idx], pt.z);
+    }
+  }
+}
+
+
+
+//overriden methods
+
+BekkerData LocalTerrainMap::getSoilDataAt(float x, float y) const{
+  return lookup_soil_table(3);
+}
+
+//Bilinear interpolation between cell centers. Unobserved cells are left out.
+float LocalTerrainMap::getAltitude(float x, float y, float z_guess) const{
+  float col_intrp = (x / map_res_) - .5f;
+  float row_intrp = (y / map_res_) - .5f;
+
+  int col_l = (int) floorf(col_intrp);
+  int row_l = (int) floorf(row_intrp);
+  float t_col = col_intrp - col_l;
+  float t_row = row_intrp - row_l;
+
+  float sum = 0;
+  float total_weight = 0;
+  for(int dr = 0; dr < 2; dr++){
+    int world_row = row_l + dr;
+    if(world_row < origin_row_ || world_row >= (origin_row_ + (int)size_)){
+      continue;
+    }
+    for(int dc = 0; dc < 2; dc++){
+      int world_col = col_l + dc;
+      if(world_col < origin_col_ || world_col >= (origin_col_ + (int)size_)){
+        continue;
+      }
+
+      unsigned idx = cellIndex(world_row, world_col);
+      if(scan_id_[idx] == 0){
+        continue;
+      }
+
+      float weight = (dr ? t_row : (1-t_row)) * (dc ? t_col : (1-t_col));
+      sum += weight*ground_z_[idx];
+      total_weight += weight;
+    }
+  }
+
+  if(total_weight <= 0){
+    return z_guess;
+  }
+  return sum / total_weight;
+}
+
+int LocalTerrainMap::isStateValid(float x, float y) const{
+  int world_row;
+  int world_col;
+  if(!worldToCell(x, y, world_row, world_col)){
+    return 0;
+  }
+
+  unsigned idx = cellIndex(world_row, world_col);
+  if(scan_id_[idx] != 0 && (max_z_[idx] - ground_z_[idx]) > obstacle_height_){
+    return 0;
+  }
+
+  return 1; //unobserved cells are optimistically free
+}
+
+std::vector<Rectangle*> LocalTerrainMap::getObstacles() const{
+  std::vector<Rectangle*> obstacles;
+  return obstacles;
+}
+
+void LocalTerrainMap::getBounds(float &max_x, float &min_x, float &max_y, float &min_y) const{
+  min_x = origin_col_*map_res_;
+  max_x = (origin_col_ + (int)size_)*map_res_;
+
+  min_y = origin_row_*map_res_;
+  max_y = (origin_row_ + (int)size_)*map_res_;
+}
@@ -0,0 +1,164 @@
+#include "MappedPcdCloud.h"
+
+#include <ros/ros.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+
+MappedPcdCloud::MappedPcdCloud(){
+  fd_ = -1;
+  map_ = NULL;
+  map_size_ = 0;
+  data_ = NULL;
+  num_points_ = 0;
+  stride_ = 0;
+  x_offset_ = 0;
+  y_offset_ = 0;
+  z_offset_ = 0;
+}
+
+MappedPcdCloud::~MappedPcdCloud(){
+  close();
+}
+
+void MappedPcdCloud::close(){
+  if(map_){
+    munmap(map_, map_size_);
+    map_ = NULL;
+  }
+  if(fd_ >= 0){
+    ::close(fd_);
+    fd_ = -1;
+  }
+  data_ = NULL;
+  num_points_ = 0;
+}
+
+int MappedPcdCloud::open(const char *pcd_fn){
+  close();
+
+  fd_ = ::open(pcd_fn, O_RDONLY);
+  if(fd_ < 0){
+    ROS_INFO("MappedPcdCloud could not open %s", pcd_fn);
+    return 0;
+  }
+
+  struct stat file_stat;
+  if(fstat(fd_, &file_stat) != 0 || file_stat.st_size == 0){
+    close();
+    return 0;
+  }
+  map_size_ = file_stat.st_size;
+
+  void *temp_map = mmap(NULL, map_size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if(temp_map == MAP_FAILED){
+    ROS_INFO("MappedPcdCloud mmap failed for %s", pcd_fn);
+    close();
+    return 0;
+  }
+  map_ = (unsigned char*) temp_map;
+  madvise(map_, map_size_, MADV_SEQUENTIAL);
+
+  //Parse the text header. It ends with the DATA line.
+  std::vector<std::string> fields;
+  std::vector<size_t> sizes;
+  std::vector<char> types;
+  std::vector<size_t> counts;
+  std::string data_type;
+  size_t pos = 0;
+
+  while(pos < map_size_ && data_type.empty()){
+    size_t line_end = pos;
+    while(line_end < map_size_ && map_[line_end] != '\n'){
+      line_end++;
+    }
+
+    std::stringstream line_ss(std::string((const char*) map_ + pos, line_end - pos));
+    std::string key;
+    line_ss >> key;
+
+    if(key == "FIELDS"){
+      std::string field;
+      while(line_ss >> field) fields.push_back(field);
+    }
+    else if(key == "SIZE"){
+      size_t temp;
+      while(line_ss >> temp) sizes.push_back(temp);
+    }
+    else if(key == "TYPE"){
+      char temp;
+      while(line_ss >> temp) types.push_back(temp);
+    }
+    else if(key == "COUNT"){
+      size_t temp;
+      while(line_ss >> temp) counts.push_back(temp);
+    }
+    else if(key == "POINTS"){
+      line_ss >> num_points_;
+    }
+    else if(key == "DATA"){
+      line_ss >> data_type;
+    }
+
+    pos = line_end + 1;
+  }
+
+  if(data_type != "binary"){
+    ROS_INFO("MappedPcdCloud %s is DATA %s, only binary can be mapped", pcd_fn, data_type.c_str());
+    close();
+    return 0;
+  }
+
+  if(counts.empty()){
+    counts.resize(fields.size(), 1);
+  }
+  if(sizes.size() != fields.size() || types.size() != fields.size() || counts.size() != fields.size()){
+    ROS_INFO("MappedPcdCloud %s has a malformed header", pcd_fn);
+    close();
+    return 0;
+  }
+
+  //Offsets of x, y and z within a point. Each has to be a 4 byte float.
+  int found = 0;
+  stride_ = 0;
+  for(unsigned i = 0; i < fields.size(); i++){
+    int is_float = (types[i] == 'F') && (sizes[i] == 4);
+    if(fields[i] == "x" && is_float){
+      x_offset_ = stride_;
+      found |= 1;
+    }
+    else if(fields[i] == "y" && is_float){
+      y_offset_ = stride_;
+      found |= 2;
+    }
+    else if(fields[i] == "z" && is_float){
+      z_offset_ = stride_;
+      found |= 4;
+    }
+    stride_ += sizes[i]*counts[i];
+  }
+
+  if(found != 7){
+    ROS_INFO("MappedPcdCloud %s doesn't have float x y z fields", pcd_fn);
+    close();
+    return 0;
+  }
+
+  if(pos + (num_points_*stride_) > map_size_){
+    ROS_INFO("MappedPcdCloud %s is truncated", pcd_fn);
+    close();
+    return 0;
+  }
+
+  data_ = map_ + pos;
+  ROS_INFO("Mapped %lu points from %s, %lu bytes per point", num_points_, pcd_fn, stride_);
+  return 1;
+}
@@ -0,0 +1,234 @@
+#include "MotionPrimitiveLibrary.h"
+
+#include <ros/ros.h>
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+
+
+
+MotionPrimitiveLibrary::MotionPrimitiveLibrary(){
+  ros::NodeHandle nh;
+  max_slope_ = 2*M_PI/180.0;
+  footprint_radius_ = .4;
+  max_lateral_speed_ = .05;
+  nh.getParam("/MotionPrimitives/max_slope", max_slope_);
+  nh.getParam("/MotionPrimitives/footprint_radius", footprint_radius_);
+  nh.getParam("/MotionPrimitives/max_lateral_speed", max_lateral_speed_);
+  
+  terrain_map_ = NULL;
+}
+
+MotionPrimitiveLibrary::~MotionPrimitiveLibrary(){
+  for(unsigned i = 0; i < tables_.size(); i++){
+    delete[] tables_[i].entries;
+  }
+}
+
+int MotionPrimitiveLibrary::load(const char *table_fn){
+  FILE *table_file = fopen(table_fn, "rb");
+  if(!table_file){
+    ROS_INFO("MotionPrimitiveLibrary could not open %s", table_fn);
+    return 0;
+  }
+  
+  Table table;
+  if(fread(&table.header, sizeof(PrimitiveTableHeader), 1, table_file) != 1 ||
+     table.header.magic != PRIMITIVE_MAGIC || table.header.version != PRIMITIVE_VERSION){
+    ROS_INFO("MotionPrimitiveLibrary %s is not a primitive table", table_fn);
+    fclose(table_file);
+    return 0;
+  }
+  
+  const PrimitiveTableHeader &h = table.header;
+  if(h.num_wz < 2 || h.num_vf < 2 || h.num_v0 < 2 || h.num_w0 < 2){
+    ROS_INFO("MotionPrimitiveLibrary %s needs at least 2 samples per axis", table_fn);
+    fclose(table_file);
+    return 0;
+  }
+  
+  size_t num_entries = (size_t)h.num_wz*h.num_vf*h.num_v0*h.num_w0;
+  table.entries = new float[num_entries*PRIMITIVE_LEN];
+  if(fread(table.entries, sizeof(float)*PRIMITIVE_LEN, num_entries, table_file) != num_entries){
+    ROS_INFO("MotionPrimitiveLibrary %s is truncated", table_fn);
+    delete[] table.entries;
+    fclose(table_file);
+    return 0;
+  }
+  fclose(table_file);
+  
+  tables_.push_back(table);
+  ROS_INFO("MotionPrimitiveLibrary loaded %lu primitives for soil %d from %s", num_entries, h.soil_index, table_fn);
+  return 1;
+}
+
+int MotionPrimitiveLibrary::write(const char *table_fn, const PrimitiveTableHeader &header, const float *entries){
+  FILE *table_file = fopen(table_fn, "wb");
+  if(!table_file){
+    ROS_INFO("MotionPrimitiveLibrary could not create %s", table_fn);
+    return 0;
+  }
+  
+  size_t num_entries = (size_t)header.num_wz*header.num_vf*header.num_v0*header.num_w0;
+  int ok = (fwrite(&header, sizeof(PrimitiveTableHeader), 1, table_file) == 1) &&
+           (fwrite(entries, sizeof(float)*PRIMITIVE_LEN, num_entries, table_file) == num_entries);
+  fclose(table_file);
+  
+  if(!ok){
+    ROS_INFO("MotionPrimitiveLibrary failed writing %s", table_fn);
+  }
+  return ok;
+}
+
+//BekkerData doesn't carry its table index, so match on the parameters.
+const MotionPrimitiveLibrary::Table* MotionPrimitiveLibrary::findTable(const BekkerData &soil) const{
+  for(unsigned i = 0; i < tables_.size(); i++){
+    BekkerData table_soil = lookup_soil_table(tables_[i].header.soil_index);
+    if(table_soil.kc == soil.kc && table_soil.kphi == soil.kphi && table_soil.n0 == soil.n0 &&
+       table_soil.n1 == soil.n1 && table_soil.phi == soil.phi){
+      return &tables_[i];
+    }
+  }
+  return NULL;
+}
+
+//Ground around the start and end can't rise or fall more than max_slope_ relative to the start.
+int MotionPrimitiveLibrary::isFlat(float x, float y, float z_guess, float end_x, float end_y) const{
+  const float max_grade = tanf(max_slope_);
+  const float r = footprint_radius_;
+  float start_alt = terrain_map_->getAltitude(x, y, z_guess);
+  
+  float sample_x[10] = {x+r, x-r, x,   x,   end_x, end_x+r, end_x-r, end_x,   end_x,   .5f*(x+end_x)};
+  float sample_y[10] = {y,   y,   y+r, y-r, end_y, end_y,   end_y,   end_y+r, end_y-r, .5f*(y+end_y)};
+  
+  for(int i = 0; i < 10; i++){
+    float dx = sample_x[i] - x;
+    float dy = sample_y[i] - y;
+    float dist = sqrtf((dx*dx) + (dy*dy));
+    if(dist < 1e-3f){
+      continue;
+    }
+    float alt = terrain_map_->getAltitude(sample_x[i], sample_y[i], z_guess);
+    if(fabsf(alt - start_alt) > (max_grade*dist)){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+//Cell index and fraction along one axis. 0 if value is off the grid.
+int MotionPrimitiveLibrary::gridCoord(float value, float min, float max, uint32_t num, uint32_t &idx, float &t){
+  if(value < min || value > max){
+    return 0;
+  }
+  float u = (value - min)*(num - 1) / (max - min);
+  idx = std::min((uint32_t) floorf(u), num - 2);
+  t = u - idx;
+  return 1;
+}
+
+int MotionPrimitiveLibrary::apply(const double *start, double Wz, double Vf, double duration, double *result) const{
+  if(!terrain_map_ || tables_.empty()){
+    return 0;
+  }
+  
+  const Table *table = findTable(terrain_map_->getSoilDataAt(start[0], start[1]));
+  if(!table){
+    return 0;
+  }
+  const PrimitiveTableHeader &h = table->header;
+  if(fabs(duration - h.duration) > 1e-6){
+    return 0;
+  }
+  
+  double qx = start[3];
+  double qy = start[4];
+  double qz = start[5];
+  double qw = start[6];
+  
+  //body z axis has to be close to vertical
+  double up_z = 1 - 2*((qx*qx) + (qy*qy));
+  if(up_z < cos(max_slope_)){
+    return 0;
+  }
+  
+  double yaw = atan2(2*((qw*qz) + (qx*qy)), 1 - 2*((qy*qy) + (qz*qz)));
+  double c = cos(yaw);
+  double s = sin(yaw);
+  
+  //Planner velocities are world frame. Rotate into the start heading.
+  float v0 = (c*start[7]) + (s*start[8]);
+  float v_lat = (-s*start[7]) + (c*start[8]);
+  float w0 = start[12];
+  if(fabsf(v_lat) > max_lateral_speed_ || fabs(start[9]) > max_lateral_speed_){
+    return 0;
+  }
+  
+  uint32_t idx[4];
+  float t[4];
+  if(!gridCoord(Wz, h.wz_min, h.wz_max, h.num_wz, idx[0], t[0]) ||
+     !gridCoord(Vf, h.vf_min, h.vf_max, h.num_vf, idx[1], t[1]) ||
+     !gridCoord(v0, h.v0_min, h.v0_max, h.num_v0, idx[2], t[2]) ||
+     !gridCoord(w0, h.w0_min, h.w0_max, h.num_w0, idx[3], t[3])){
+    return 0;
+  }
+  
+  //Multilinear over the 16 surrounding entries.
+  float prim[PRIMITIVE_LEN] = {0};
+  for(unsigned corner = 0; corner < 16; corner++){
+    float weight = 1;
+    uint32_t i_wz = idx[0] + (corner & 1);
+    uint32_t i_vf = idx[1] + ((corner >> 1) & 1);
+    uint32_t i_v0 = idx[2] + ((corner >> 2) & 1);
+    uint32_t i_w0 = idx[3] + ((corner >> 3) & 1);
+    for(int axis = 0; axis < 4; axis++){
+      weight *= ((corner >> axis) & 1) ? t[axis] : (1 - t[axis]);
+    }
+    if(weight == 0){
+      continue;
+    }
+    
+    size_t entry = (((((size_t)i_w0*h.num_v0) + i_v0)*h.num_vf + i_vf)*h.num_wz) + i_wz;
+    const float *values = &table->entries[entry*PRIMITIVE_LEN];
+    for(int i = 0; i < PRIMITIVE_LEN; i++){
+      prim[i] += weight*values[i];
+    }
+  }
+  
+  double end_x = start[0] + (c*prim[PRIM_DX]) - (s*prim[PRIM_DY]);
+  double end_y = start[1] + (s*prim[PRIM_DX]) + (c*prim[PRIM_DY]);
+  
+  if(!isFlat(start[0], start[1], start[2], end_x, end_y)){
+    return 0;
+  }
+  if(findTable(terrain_map_->getSoilDataAt(end_x, end_y)) != table){
+    return 0;
+  }
+  
+  result[0] = end_x;
+  result[1] = end_y;
+  result[2] = start[2] + (terrain_map_->getAltitude(end_x, end_y, start[2]) - terrain_map_->getAltitude(start[0], start[1], start[2]));
+  
+  //yaw rotation about world z applied on the left of the start orientation
+  double hz = sin(.5*prim[PRIM_DYAW]);
+  double hw = cos(.5*prim[PRIM_DYAW]);
+  result[3] = (hw*qx) - (hz*qy);
+  result[4] = (hw*qy) + (hz*qx);
+  result[5] = (hw*qz) + (hz*qw);
+  result[6] = (hw*qw) - (hz*qz);
+  
+  result[7] = (c*prim[PRIM_VX]) - (s*prim[PRIM_VY]);
+  result[8] = (s*prim[PRIM_VX]) + (c*prim[PRIM_VY]);
+  result[9] = prim[PRIM_VZ];
+  
+  result[10] = (c*prim[PRIM_WX]) - (s*prim[PRIM_WY]);
+  result[11] = (s*prim[PRIM_WX]) + (c*prim[PRIM_WY]);
+  result[12] = prim[PRIM_WZ];
+  
+  result[13] = prim[PRIM_QD1];
+  result[14] = prim[PRIM_QD2];
+  result[15] = prim[PRIM_QD3];
+  result[16] = prim[PRIM_QD4];
+  return 1;
+}
@@ -1,4 +1,7 @@
 #include "OctoTerrainMap.h"
+#include "MappedPcdCloud.h"
+#include "GlobalParams.h"
+#include "TerrainBuildProfiler.h"
 
 #include <pcl/filters/extract_indices.h>
 #include <pcl/point_types.h>
@@ -10,10 +13,18 @@
 #include <pcl/visualization/cloud_viewer.h>
 #include <pcl/filters/passthrough.h>
 #include <pcl/segmentation/region_growing.h>
+#include <pcl/common/io.h>
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <unistd.h>
+#include <string.h>
 #include <math.h>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <limits>
 
 unsigned OctoTerrainMap::has_octomap_ground = 0;
 pcl::PointCloud<pcl::PointXYZ> OctoTerrainMap::pcl_cloud;
@@ -48,15 +59,12 @@ void OctoTerrainMap::get_cloud_callback(const sensor_msgs::PointCloud2ConstPtr&
 
 
 
-OctoTerrainMap::OctoTerrainMap(const char *site_cloud_fn){
+OctoTerrainMap::OctoTerrainMap(const char *site_cloud_fn, const char *path_to_global_cloud_override){
     private_nh_ = new ros::NodeHandle("~/octo_terrain_map");
+    pool_ = new ThreadPool(GlobalParams::get_num_threads());
     ros::Rate loop_rate(10);
     
     pcl::PointCloud<pcl::PointXYZ>::Ptr cloudPtr(new pcl::PointCloud<pcl::PointXYZ>);
-    pcl::io::loadPCDFile<pcl::PointXYZ>(site_cloud_fn, pcl_cloud);
-    *cloudPtr = pcl_cloud;
-    
-    ROS_INFO("Got octomap_ground pointcloud");
     
     float radius;
     float normal_radius;
@@ -73,97 +81,207 @@ OctoTerrainMap::OctoTerrainMap(const char *site_cloud_fn){
     private_nh_->getParam("/TerrainMap/num_neighbors", num_neighbors);
     private_nh_->getParam("/TerrainMap/num_neighbors_avg", num_neighbors_avg);
     private_nh_->getParam("/TerrainMap/occupancy_threshold", occupancy_threshold_);    
+    reject_occupied_ = true;
+    private_nh_->getParam("/TerrainMap/reject_occupied_cells", reject_occupied_);
+    revision_ = 0;
+    
+    std::string ground_segmentation = "region_growing";
+    float ground_cell_size = .5f;
+    float ground_height_threshold = .15f;
+    float ground_max_slope = .5f;
+    float ground_max_window = 10;
+    private_nh_->getParam("/TerrainMap/ground_segmentation", ground_segmentation);
+    private_nh_->getParam("/TerrainMap/ground_cell_size", ground_cell_size);
+    private_nh_->getParam("/TerrainMap/ground_height_threshold", ground_height_threshold);
+    private_nh_->getParam("/TerrainMap/ground_max_slope", ground_max_slope);
+    private_nh_->getParam("/TerrainMap/ground_max_window", ground_max_window);
     
     private_nh_->getParam("/TerrainMap/reprocess_global_cloud", should_process_cloud);
-    private_nh_->getParam("/TerrainMap/path_to_global_cloud", path_to_global_cloud);
+    if(path_to_global_cloud_override){
+      path_to_global_cloud = path_to_global_cloud_override;
+    }
+    else{
+      private_nh_->getParam("/TerrainMap/path_to_global_cloud", path_to_global_cloud);
+    }
 
     std::string global_obstacle_fn = path_to_global_cloud + "global_obstacles.pcd"; //filename of clouds
     std::string global_ground_fn = path_to_global_cloud + "global_ground.pcd";
+    std::string global_header_fn = path_to_global_cloud + "global_cloud_header.txt";
+    
+    //Records what the processed clouds were made from. If the site cloud or any of
+    //the processing parameters changed, the saved clouds are stale.
+    std::stringstream header_ss;
+    header_ss << "auvsl_rrt_processed_cloud_version 1\n";
+    header_ss << "site_cloud_filename " << site_cloud_fn << "\n";
+    header_ss << "filter_radius " << radius << "\n";
+    header_ss << "normal_radius " << normal_radius << "\n";
+    header_ss << "smoothness_threshold " << smoothness_threshold << "\n";
+    header_ss << "curvature_threshold " << curvature_threshold << "\n";
+    header_ss << "num_neighbors " << num_neighbors << "\n";
+    header_ss << "ground_segmentation " << ground_segmentation << "\n";
+    if(ground_segmentation == "grid"){
+      header_ss << "ground_cell_size " << ground_cell_size << "\n";
+      header_ss << "ground_height_threshold " << ground_height_threshold << "\n";
+      header_ss << "ground_max_slope " << ground_max_slope << "\n";
+      header_ss << "ground_max_window " << ground_max_window << "\n";
+    }
+    std::string processing_header = header_ss.str();
+    
+    if(!should_process_cloud){
+      std::ifstream header_file(global_header_fn.c_str());
+      std::stringstream saved_header;
+      saved_header << header_file.rdbuf();
+      if(!header_file.is_open() || saved_header.str() != processing_header){
+        ROS_INFO("Processed clouds in %s don't match the current parameters. Reprocessing.", path_to_global_cloud.c_str());
+        should_process_cloud = 1;
+      }
+    }
 
     pcl::PointCloud<pcl::PointXYZ>::Ptr obstacle_cloudPtr(new pcl::PointCloud<pcl::PointXYZ>);
     pcl::PointCloud<pcl::PointXYZ>::Ptr ground_cloudPtr(new pcl::PointCloud<pcl::PointXYZ>);
     
+    TerrainBuildProfiler profiler(site_cloud_fn);
+    
     if(should_process_cloud){
       ROS_INFO("Eliminate points above 1m height");
-      pcl::PassThrough<pcl::PointXYZ> pass;
-      
-      pass.setInputCloud(cloudPtr);
-      pass.setFilterFieldName("z");
-      pass.setFilterLimits(-10,1);
-      pass.filter(pcl_cloud);
-
-      *cloudPtr = pcl_cloud;
-      
-      ROS_INFO("Starting normal estimation");
-      pcl::search::Search<pcl::PointXYZ>::Ptr tree (new pcl::search::KdTree<pcl::PointXYZ>);
-      pcl::PointCloud <pcl::Normal>::Ptr normals (new pcl::PointCloud <pcl::Normal>);
-      pcl::NormalEstimation<pcl::PointXYZ, pcl::Normal> normal_estimator;
-      normal_estimator.setSearchMethod (tree);
-      normal_estimator.setInputCloud (cloudPtr);
-      normal_estimator.setRadiusSearch (normal_radius);
-      normal_estimator.compute (*normals);
-      
-      ROS_INFO("Done estimating normals, onto region growing");
-      pcl::RegionGrowing<pcl::PointXYZ, pcl::Normal> reg;
-      reg.setMinClusterSize (50);
-      reg.setMaxClusterSize (1000000000);
-      reg.setSearchMethod (tree);
-      reg.setNumberOfNeighbours (num_neighbors);
-      reg.setInputCloud (cloudPtr);
-      reg.setInputNormals (normals);
-      reg.setSmoothnessThreshold (smoothness_threshold);
-      reg.setCurvatureThreshold (curvature_threshold);
-    
-      std::vector<pcl::PointIndices> clusters;
-      reg.extract(clusters);
-      ROS_INFO("Num clusters %lu", clusters.size());
-
-      unsigned biggest_cluster = 0;
-      unsigned most_points = clusters[0].indices.size();
-      unsigned temp_num_points;
-      ROS_INFO("Size of cluster %u is %lu", 0, clusters[0].indices.size());
-      for(unsigned i = 1; i < clusters.size(); i++){
-        temp_num_points = clusters[i].indices.size();
-        ROS_INFO("Size of cluster %u is %u", i, temp_num_points);
-        if(temp_num_points > most_points){
-          most_points = temp_num_points;
-          biggest_cluster = i;
+      MappedPcdCloud mapped_cloud;
+      if(mapped_cloud.open(site_cloud_fn)){
+        profiler.begin("load_pass_through", mapped_cloud.size());
+        //Filter straight out of the mapped file so the site cloud is never copied whole.
+        cloudPtr->points.reserve(mapped_cloud.size());
+        for(size_t i = 0; i < mapped_cloud.size(); i++){
+          float x = mapped_cloud.x(i);
+          float y = mapped_cloud.y(i);
+          float z = mapped_cloud.z(i);
+          if(std::isfinite(x) && std::isfinite(y) && std::isfinite(z) && z >= -10 && z <= 1){
+            cloudPtr->points.push_back(pcl::PointXYZ(x, y, z));
+          }
         }
+        cloudPtr->width = cloudPtr->points.size();
+        cloudPtr->height = 1;
+        cloudPtr->is_dense = true;
+        mapped_cloud.close();
+        profiler.end(cloudPtr->points.size());
       }
+      else{
+        profiler.begin("load", 0);
+        pcl::io::loadPCDFile<pcl::PointXYZ>(site_cloud_fn, *cloudPtr);
+        profiler.end(cloudPtr->points.size());
+        
+        profiler.begin("pass_through", cloudPtr->points.size());
+        pcl::PassThrough<pcl::PointXYZ> pass;
+        pass.setInputCloud(cloudPtr);
+        pass.setFilterFieldName("z");
+        pass.setFilterLimits(-10,1);
+        pass.filter(pcl_cloud);
+        
+        *cloudPtr = pcl_cloud;
+        profiler.end(cloudPtr->points.size());
+      }
+      ROS_INFO("Got octomap_ground pointcloud, %lu points", cloudPtr->points.size());
+      
+      if(ground_segmentation == "grid"){
+        profiler.begin("grid_segmentation", cloudPtr->points.size());
+        segmentGroundGrid(cloudPtr, ground_cloudPtr, obstacle_cloudPtr, ground_cell_size, ground_height_threshold, ground_max_slope, ground_max_window);
+        profiler.end(ground_cloudPtr->points.size());
+      }
+      else{
+        ROS_INFO("Starting normal estimation");
+        profiler.begin("normals", cloudPtr->points.size());
+        pcl::search::Search<pcl::PointXYZ>::Ptr tree (new pcl::search::KdTree<pcl::PointXYZ>);
+        pcl::PointCloud <pcl::Normal>::Ptr normals (new pcl::PointCloud <pcl::Normal>);
+        pcl::NormalEstimation<pcl::PointXYZ, pcl::Normal> normal_estimator;
+        normal_estimator.setSearchMethod (tree);
+        normal_estimator.setInputCloud (cloudPtr);
+        normal_estimator.setRadiusSearch (normal_radius);
+        normal_estimator.compute (*normals);
+        profiler.end(normals->points.size());
+      
+        ROS_INFO("Done estimating normals, onto region growing");
+        profiler.begin("region_growing", cloudPtr->points.size());
+        pcl::RegionGrowing<pcl::PointXYZ, pcl::Normal> reg;
+        reg.setMinClusterSize (50);
+        reg.setMaxClusterSize (1000000000);
+        reg.setSearchMethod (tree);
+        reg.setNumberOfNeighbours (num_neighbors);
+        reg.setInputCloud (cloudPtr);
+        reg.setInputNormals (normals);
+        reg.setSmoothnessThreshold (smoothness_threshold);
+        reg.setCurvatureThreshold (curvature_threshold);
+    
+        std::vector<pcl::PointIndices> clusters;
+        reg.extract(clusters);
+        ROS_INFO("Num clusters %lu", clusters.size());
 
-      pcl::PointIndices::Ptr ground_indices(new pcl::PointIndices());
-      *ground_indices = clusters[biggest_cluster];
-      pcl::ExtractIndices<pcl::PointXYZ> extract_ground;
-      extract_ground.setInputCloud(cloudPtr);
-      extract_ground.setIndices(ground_indices);
-      extract_ground.setNegative(false);
-      extract_ground.filter(*ground_cloudPtr);
-      extract_ground.setNegative(true);
-      extract_ground.filter(*obstacle_cloudPtr);    
+        unsigned biggest_cluster = 0;
+        unsigned most_points = clusters[0].indices.size();
+        unsigned temp_num_points;
+        ROS_INFO("Size of cluster %u is %lu", 0, clusters[0].indices.size());
+        for(unsigned i = 1; i < clusters.size(); i++){
+          temp_num_points = clusters[i].indices.size();
+          ROS_INFO("Size of cluster %u is %u", i, temp_num_points);
+          if(temp_num_points > most_points){
+            most_points = temp_num_points;
+            biggest_cluster = i;
+          }
+        }
 
-      pcl::search::KdTree<pcl::PointXYZ>::Ptr mls_tree (new pcl::search::KdTree<pcl::PointXYZ>);
-      pcl::MovingLeastSquares<pcl::PointXYZ, pcl::PointXYZ> mls;
-    
-      mls.setInputCloud(ground_cloudPtr);
-      mls.setPolynomialOrder(2);
-      mls.setSearchMethod(mls_tree);
-      mls.setSearchRadius(radius);
-      mls.setComputeNormals(false);
-    
+        pcl::PointIndices::Ptr ground_indices(new pcl::PointIndices());
+        *ground_indices = clusters[biggest_cluster];
+        pcl::ExtractIndices<pcl::PointXYZ> extract_ground;
+        extract_ground.setInputCloud(cloudPtr);
+        extract_ground.setIndices(ground_indices);
+        extract_ground.setNegative(false);
+        extract_ground.filter(*ground_cloudPtr);
+        extract_ground.setNegative(true);
+        extract_ground.filter(*obstacle_cloudPtr);    
+        profiler.end(ground_cloudPtr->points.size());
+      }
+      
       ROS_INFO("about to smooth the point cloud");
-      mls.process(pcl_cloud);
+      profiler.begin("mls", ground_cloudPtr->points.size());
+      smoothGroundCloud(ground_cloudPtr, radius, pcl_cloud);
+      profiler.end(pcl_cloud.points.size());
       ROS_INFO("point cloud smoothed");
     
       *ground_cloudPtr = pcl_cloud;
  
       
-      pcl::io::savePCDFile(global_obstacle_fn, *obstacle_cloudPtr);
-      pcl::io::savePCDFile(global_ground_fn, *ground_cloudPtr);
+      //Binary compressed so loading is limited by the disk and not by parsing text.
+      profiler.begin("save_processed", ground_cloudPtr->points.size() + obstacle_cloudPtr->points.size());
+      pcl::io::savePCDFileBinaryCompressed(global_obstacle_fn, *obstacle_cloudPtr);
+      pcl::io::savePCDFileBinaryCompressed(global_ground_fn, *ground_cloudPtr);
+      
+      std::ofstream header_file(global_header_fn.c_str());
+      header_file << processing_header;
+      header_file.close();
+      profiler.end(ground_cloudPtr->points.size() + obstacle_cloudPtr->points.size());
     }
     else{
+      profiler.begin("load_processed", 0);
       pcl::io::loadPCDFile<pcl::PointXYZ>(global_obstacle_fn, *obstacle_cloudPtr);
       pcl::io::loadPCDFile<pcl::PointXYZ>(global_ground_fn, *ground_cloudPtr);
+      profiler.end(ground_cloudPtr->points.size() + obstacle_cloudPtr->points.size());
+    }
+    
+    //Octree has to be built before computeOccupancyGrid flattens the obstacles.
+    float octree_res = .1f;
+    vehicle_height_ = .4f;
+    max_clearance_ = 2;
+    private_nh_->getParam("/TerrainMap/octree_res", octree_res);
+    private_nh_->getParam("/TerrainMap/vehicle_height", vehicle_height_);
+    private_nh_->getParam("/TerrainMap/max_clearance", max_clearance_);
+    
+    ROS_INFO("Building octree from the obstacle cloud");
+    profiler.begin("octree", obstacle_cloudPtr->points.size());
+    octomap_ = new octomap::OcTree(octree_res);
+    for(unsigned i = 0; i < obstacle_cloudPtr->points.size(); i++){
+      const pcl::PointXYZ &pt = obstacle_cloudPtr->points[i];
+      octomap_->updateNode(octomap::point3d(pt.x, pt.y, pt.z), true, true);
     }
+    octomap_->updateInnerOccupancy();
+    profiler.end(octomap_->getNumLeafNodes());
+    ROS_INFO("Octree has %lu leaves", octomap_->getNumLeafNodes());
     
     cloud_pub1_ = private_nh_->advertise<sensor_msgs::PointCloud2>("ground_cloud", 100);
     cloud_pub2_ = private_nh_->advertise<sensor_msgs::PointCloud2>("raw_cloud", 100);    
@@ -175,81 +293,65 @@ OctoTerrainMap::OctoTerrainMap(const char *site_cloud_fn){
     for(unsigned i = 0; i < ground_cloudPtr->points.size(); i++){
      ground_cloudPtr->points[i].z = 0;
     }
+    profiler.begin("kdtree", ground_cloudPtr->points.size());
     kdtree.setInputCloud(ground_cloudPtr);
     kdtree.setSortedResults(true);
+    profiler.end(ground_cloudPtr->points.size());
     
     ROS_INFO("Created KDtree");
         
     
     ROS_INFO("cols %u  rows %u   res %f   x_origin %f   y_origin %f", cols_, rows_, map_res_, x_origin_, y_origin_);
     
-    float *temp_elev_map = new float[rows_*cols_];
+    //Unfiltered layers are kept so edits can be re-blurred locally. See refilter.
+    raw_elev_map_ = new float[rows_*cols_];
     elev_map_ = new float[rows_*cols_];
-    computeElevationGrid(temp_elev_map);
+    unobserved_ = new unsigned char[rows_*cols_];
+    profiler.begin("elevation", pcl_cloud.points.size());
+    computeElevationGrid(raw_elev_map_);
+    profiler.end(rows_*cols_);
     ROS_INFO("Done precomputing elevation grid");
     
     
     //gaussian blur of occ_grid to smooth it out and reduce noise from terrain incorrectly labeled as obstacle.
     ROS_INFO("Goind to compute our own occupancy grid");
-    float *temp_occ_grid = new float[rows_*cols_];
-    computeOccupancyGrid(obstacle_cloudPtr, temp_occ_grid);
+    raw_occ_grid_ = new float[rows_*cols_];
+    profiler.begin("occupancy", obstacle_cloudPtr->points.size());
+    computeOccupancyGrid(obstacle_cloudPtr, raw_occ_grid_);
+    profiler.end(rows_*cols_);
     occ_grid_blur_ = new float[rows_*cols_];
     ROS_INFO("We are now going to blur the grid");
     
+    profiler.begin("blur", rows_*cols_);
+    initBlurKernel();
+    blurRegion(0, 0, rows_-1, cols_-1);
+    is_dirty_ = 0;
+    profiler.end(rows_*cols_);
     
-    const int kernel_size = 10;
+    ROS_INFO("THE GRID IS A BLUR");
     
-    for(int i = 0; i < rows_; i++){
-      for(int j = 0; j < cols_; j++){
-          occ_grid_blur_[(i*cols_) + j] = temp_occ_grid[(i*cols_) + j];//msg->data[(i*cols_) + j];
-          elev_map_[(i*cols_) + j] = temp_elev_map[(i*cols_) + j];// = 2*((i+j)%2) - 1;
-      }
+    //Needs the final elevation map because clearance is measured from the ground.
+    profiler.begin("clearance", rows_*cols_);
+    clearance_map_ = new float[rows_*cols_];
+    for(unsigned i = 0; i < rows_*cols_; i++){
+      computeClearance(i);
     }
+    profiler.end(rows_*cols_);
+    ROS_INFO("Computed clearance layer");
     
-    float sigma_sq = 50;
-    int side_len = (2*kernel_size)+1;
-    float kernel_array[side_len*side_len];
-    float dist_sq;
-    
-    for(int i = 0; i < side_len; i++){
-      for(int j = 0; j < side_len; j++){
-        int dx = j - kernel_size;
-        int dy = i - kernel_size;
-        dist_sq = (dx*dx) + (dy*dy);
-        kernel_array[(i*side_len)+j] = expf(-.5f*dist_sq/sigma_sq);
-      }
-    }
+    profiler.begin("occupancy_bits", rows_*cols_);
+    occ_bits_ = NULL;
+    occ_sat_ = NULL;
+    updateOccupancyBits(0, 0, rows_-1, cols_-1);
+    profiler.end(rows_*cols_);
     
-    for(int i = 0; i < rows_; i++){
-      for(int j = 0; j < cols_; j++){
-        
-        float weight;
-        float total_weight = 0;
-        float occ_sum = 0;
-        float elev_sum = 0;
-        
-        for(int k = std::max((int)0,(int)(i-kernel_size)); k <= std::min((int)(rows_-1),(int)(i+kernel_size)); k++){
-            int dy = k - i + kernel_size;
-            unsigned kernel_idx_row = dy*side_len;
-            for(int m = std::max((int)0,int(j-kernel_size)); m <= std::min(int(cols_-1),int(j+kernel_size)); m++){
-                int dx = m - j + kernel_size;
-                
-                weight = kernel_array[kernel_idx_row + dx];//expf(-1.0*dist_sq/sigma_sq);
-                occ_sum += weight*temp_occ_grid[(k*cols_) + m];//msg->data[((i+k)*cols_) + j+m];
-                elev_sum += weight*temp_elev_map[(k*cols_) + m];
-                total_weight += weight;
-                //ROS_INFO("Dist %f   weight %f", dist_sq, weight);          
-            }
-        }
-        //ROS_INFO("Sum %f    total_weight %f", sum, total_weight);
-        
-        occ_grid_blur_[(i*cols_) + j] = occ_sum / total_weight;
-        elev_map_[(i*cols_) + j] = (elev_sum / total_weight);
-      }
+    profiler.printSummary();
+    std::string build_report_fn;
+    private_nh_->getParam("/TerrainMap/build_report_filename", build_report_fn);
+    if(!build_report_fn.empty()){
+      profiler.writeReport(build_report_fn.c_str());
     }
     
-    ROS_INFO("THE GRID IS A BLUR");
-    
     
     
     
@@ -278,15 +380,194 @@ OctoTerrainMap::OctoTerrainMap(const char *site_cloud_fn){
     log_file.close();
     */
 
-    delete[] temp_elev_map;
     delete[] inflated_occ_grid;
 }
 
 
+//Use loadDem to fill in the grids.
+OctoTerrainMap::OctoTerrainMap(){
+    private_nh_ = new ros::NodeHandle("~/octo_terrain_map");
+    pool_ = new ThreadPool(GlobalParams::get_num_threads());
+    
+    private_nh_->getParam("/TerrainMap/occupancy_threshold", occupancy_threshold_);
+    private_nh_->getParam("/TerrainMap/elevation_map_res", map_res_);
+    reject_occupied_ = true;
+    private_nh_->getParam("/TerrainMap/reject_occupied_cells", reject_occupied_);
+    revision_ = 0;
+    
+    float octree_res = .1f;
+    vehicle_height_ = .4f;
+    max_clearance_ = 2;
+    private_nh_->getParam("/TerrainMap/octree_res", octree_res);
+    private_nh_->getParam("/TerrainMap/vehicle_height", vehicle_height_);
+    private_nh_->getParam("/TerrainMap/max_clearance", max_clearance_);
+    octomap_ = new octomap::OcTree(octree_res); //empty until insertObstaclePoints
+    
+    rows_ = 0;
+    cols_ = 0;
+    elev_map_ = NULL;
+    occ_grid_blur_ = NULL;
+    clearance_map_ = NULL;
+    
+    //DEM layers come pre-filtered, so there is nothing to refilter.
+    raw_elev_map_ = NULL;
+    raw_occ_grid_ = NULL;
+    blur_kernel_ = NULL;
+    is_dirty_ = 0;
+    
+    occ_bits_ = NULL;
+    occ_sat_ = NULL;
+    unobserved_ = NULL;
+}
+
 OctoTerrainMap::~OctoTerrainMap(){
   delete private_nh_;
+  delete pool_;
   delete[] elev_map_;
-  //delete octomap_;
+  delete[] occ_grid_blur_;
+  delete[] clearance_map_;
+  delete[] raw_elev_map_;
+  delete[] raw_occ_grid_;
+  delete[] blur_kernel_;
+  delete[] occ_bits_;
+  delete[] occ_sat_;
+  delete[] unobserved_;
+  delete octomap_;
+}
+
+
+//Skips the whole point cloud pipeline. The DEM is resampled straight onto an
+//elevation_map_res grid covering the same extent. occ_fn is an optional raster
+//in the same units as the occupancy grid (points per cell) and can be NULL.
+int OctoTerrainMap::loadDem(const char *dem_fn, const char *occ_fn){
+    DemReader dem_reader;
+    if(!dem_reader.open(dem_fn)){
+      return 0;
+    }
+    
+    x_origin_ = dem_reader.xllcorner_;
+    y_origin_ = dem_reader.yllcorner_;
+    cols_ = (unsigned) ceilf((dem_reader.ncols_*dem_reader.cellsize_) / map_res_);
+    rows_ = (unsigned) ceilf((dem_reader.nrows_*dem_reader.cellsize_) / map_res_);
+    x_max_ = x_origin_ + (cols_*map_res_);
+    y_max_ = y_origin_ + (rows_*map_res_);
+    
+    ROS_INFO("cols %u  rows %u   res %f   x_origin %f   y_origin %f", cols_, rows_, map_res_, x_origin_, y_origin_);
+    
+    delete[] elev_map_;
+    delete[] occ_grid_blur_;
+    delete[] clearance_map_;
+    delete[] occ_bits_;
+    delete[] occ_sat_;
+    occ_bits_ = NULL;
+    occ_sat_ = NULL;
+    elev_map_ = new float[rows_*cols_];
+    occ_grid_blur_ = new float[rows_*cols_];
+    clearance_map_ = new float[rows_*cols_];
+    
+    //A raster has no idea what is under an obstacle. Treat everything occupied as blocking.
+    for(unsigned i = 0; i < rows_*cols_; i++){
+      clearance_map_[i] = 0;
+    }
+    
+    loadDemLayer(dem_reader, elev_map_);
+    
+    //Cells with no data are interpolated from their neighbors so the vehicle doesn't drive off a cliff.
+    delete[] unobserved_;
+    unobserved_ = new unsigned char[rows_*cols_];
+    unsigned num_valid = 0;
+    for(unsigned i = 0; i < rows_*cols_; i++){
+      unobserved_[i] = std::isnan(elev_map_[i]);
+      num_valid += !unobserved_[i];
+    }
+    fillHoles(elev_map_, unobserved_);
+    ROS_INFO("Filled %u DEM cells with no data", (rows_*cols_) - num_valid);
+    
+    if(occ_fn && occ_fn[0]){
+      DemReader occ_reader;
+      if(!occ_reader.open(occ_fn)){
+        return 0;
+      }
+      
+      loadDemLayer(occ_reader, occ_grid_blur_);
+      for(unsigned i = 0; i < rows_*cols_; i++){
+        if(std::isnan(occ_grid_blur_[i])){
+          occ_grid_blur_[i] = 0;
+        }
+      }
+    }
+    else{
+      for(unsigned i = 0; i < rows_*cols_; i++){
+        occ_grid_blur_[i] = 0;
+      }
+    }
+    
+    updateOccupancyBits(0, 0, rows_-1, cols_-1);
+    
+    ROS_INFO("Done loading DEM");
+    return 1;
+}
+
+//Bilinear resampling of a raster onto this map's grid. Output rows are filled
+//from north to south so only two source rows need to be held at once.
+//Cells that only touch NODATA samples are set to NAN.
+void OctoTerrainMap::loadDemLayer(DemReader &reader, float *grid){
+    const int nrows = reader.nrows_;
+    const int ncols = reader.ncols_;
+    
+    float *upper_row = new float[ncols]; //source row last_row-1
+    float *lower_row = new float[ncols]; //source row last_row
+    int last_row = -1;
+    
+    for(int r = rows_-1; r >= 0; r--){
+      float y = y_origin_ + (r*map_res_);
+      
+      //fractional source row, counted from the top of the raster
+      float row_intrp = (nrows - .5f) - ((y - reader.yllcorner_) / reader.cellsize_);
+      row_intrp = std::max(std::min(row_intrp, (float)(nrows-1)), 0.0f);
+      int row_a = floorf(row_intrp);
+      int row_b = std::min(row_a+1, nrows-1);
+      float t_row = row_intrp - row_a;
+      
+      while(last_row < row_b){
+        std::swap(upper_row, lower_row);
+        if(!reader.readRow(lower_row)){
+          for(int c = 0; c < ncols; c++){
+            lower_row[c] = reader.nodata_;
+          }
+        }
+        last_row++;
+      }
+      
+      const float *src_a = (row_a == last_row) ? lower_row : upper_row;
+      const float *src_b = lower_row;
+      
+      for(unsigned c = 0; c < cols_; c++){
+        float x = x_origin_ + (c*map_res_);
+        float col_intrp = ((x - reader.xllcorner_) / reader.cellsize_) - .5f;
+        col_intrp = std::max(std::min(col_intrp, (float)(ncols-1)), 0.0f);
+        int col_a = floorf(col_intrp);
+        int col_b = std::min(col_a+1, ncols-1);
+        float t_col = col_intrp - col_a;
+        
+        float samples[4] = {src_a[col_a], src_a[col_b], src_b[col_a], src_b[col_b]};
+        float weights[4] = {(1-t_row)*(1-t_col), (1-t_row)*t_col, t_row*(1-t_col), t_row*t_col};
+        
+        float sum = 0;
+        float total_weight = 0;
+        for(unsigned k = 0; k < 4; k++){
+          if(samples[k] != reader.nodata_ && !std::isnan(samples[k])){
+            sum += weights[k]*samples[k];
+            total_weight += weights[k];
+          }
+        }
+        
+        grid[(r*cols_) + c] = (total_weight > 0) ? (sum / total_weight) : NAN;
+      }
+    }
+    
+    delete[] upper_row;
+    delete[] lower_row;
 }
 
 
@@ -330,6 +611,252 @@ void OctoTerrainMap::computePclOriginSize(){
   y_max_ = y_origin_ + (rows_*map_res_);
 }
 
+//MLS split into square tiles that are smoothed in parallel. Each tile is given
+//every point within filter_radius of it (the halo) but only its interior points
+//are projected, so each output point sees the same neighbors it would in one big
+//MLS. Tiles are concatenated in order so the output doesn't depend on scheduling.
+void OctoTerrainMap::smoothGroundCloud(pcl::PointCloud<pcl::PointXYZ>::Ptr ground_cloud, float radius, pcl::PointCloud<pcl::PointXYZ> &smoothed){
+    float tile_size = 20;
+    private_nh_->getParam("/TerrainMap/mls_tile_size", tile_size);
+    
+    const std::vector<pcl::PointXYZ, Eigen::aligned_allocator<pcl::PointXYZ>> &points = ground_cloud->points;
+    smoothed.clear();
+    if(points.empty()){
+      return;
+    }
+    
+    float x_min = points[0].x;
+    float y_min = points[0].y;
+    float x_max = points[0].x;
+    float y_max = points[0].y;
+    for(unsigned i = 1; i < points.size(); i++){
+      x_min = std::min(x_min, points[i].x);
+      y_min = std::min(y_min, points[i].y);
+      x_max = std::max(x_max, points[i].x);
+      y_max = std::max(y_max, points[i].y);
+    }
+    
+    if(tile_size <= 0){ //one tile, same as the plain MLS
+      tile_size = std::max(x_max - x_min, y_max - y_min) + 1;
+    }
+    
+    int tile_cols = std::max(1, (int) ceilf((x_max - x_min) / tile_size));
+    int tile_rows = std::max(1, (int) ceilf((y_max - y_min) / tile_size));
+    unsigned num_tiles = tile_cols*tile_rows;
+    
+    //members holds each tile's interior and halo points, interior_local says
+    //which of those the tile owns.
+    std::vector<std::vector<int>> members(num_tiles);
+    std::vector<std::vector<int>> interior_local(num_tiles);
+    
+    for(unsigned i = 0; i < points.size(); i++){
+      float tx = (points[i].x - x_min) / tile_size;
+      float ty = (points[i].y - y_min) / tile_size;
+      int own_col = std::min((int)tx, tile_cols-1);
+      int own_row = std::min((int)ty, tile_rows-1);
+      
+      int col_lo = std::max(0, (int) floorf(tx - (radius / tile_size)));
+      int col_hi = std::min(tile_cols-1, (int) floorf(tx + (radius / tile_size)));
+      int row_lo = std::max(0, (int) floorf(ty - (radius / tile_size)));
+      int row_hi = std::min(tile_rows-1, (int) floorf(ty + (radius / tile_size)));
+      
+      for(int r = row_lo; r <= row_hi; r++){
+        for(int c = col_lo; c <= col_hi; c++){
+          unsigned tile = (r*tile_cols) + c;
+          if(r == own_row && c == own_col){
+            interior_local[tile].push_back(members[tile].size());
+          }
+          members[tile].push_back(i);
+        }
+      }
+    }
+    
+    ROS_INFO("Smoothing %u MLS tiles of %f m", num_tiles, tile_size);
+    
+    std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> tile_outputs(num_tiles);
+    ThreadPool &pool = *pool_;
+    pool.parallelFor(num_tiles, [&](unsigned tile, unsigned worker){
+      if(interior_local[tile].empty()){
+        return;
+      }
+      
+      pcl::PointCloud<pcl::PointXYZ>::Ptr tile_cloud(new pcl::PointCloud<pcl::PointXYZ>);
+      pcl::copyPointCloud(*ground_cloud, members[tile], *tile_cloud);
+      
+      pcl::IndicesPtr tile_indices(new std::vector<int>(interior_local[tile]));
+      
+      pcl::search::KdTree<pcl::PointXYZ>::Ptr mls_tree (new pcl::search::KdTree<pcl::PointXYZ>);
+      pcl::MovingLeastSquares<pcl::PointXYZ, pcl::PointXYZ> mls;
+      mls.setInputCloud(tile_cloud);
+      mls.setIndices(tile_indices);
+      mls.setPolynomialOrder(2);
+      mls.setSearchMethod(mls_tree);
+      mls.setSearchRadius(radius);
+      mls.setComputeNormals(false);
+      tile_outputs[tile].reset(new pcl::PointCloud<pcl::PointXYZ>);
+      mls.process(*tile_outputs[tile]);
+    });
+    
+    for(unsigned tile = 0; tile < num_tiles; tile++){
+      if(tile_outputs[tile]){
+        smoothed += *tile_outputs[tile];
+      }
+    }
+}
+
+//Grid based alternative to normal estimation + region growing.
+//A progressive morphological filter over the lowest point in each cell. The
+//min grid is opened with windows that double up to max_window meters, and any
+//cell that sticks up out of the opened surface by more than the slope allows
+//is not ground. Points in ground cells that are within height_threshold of the
+//surface are ground, everything else is an obstacle.
+void OctoTerrainMap::segmentGroundGrid(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud, pcl::PointCloud<pcl::PointXYZ>::Ptr ground_cloud, pcl::PointCloud<pcl::PointXYZ>::Ptr obstacle_cloud,
+                                       float cell_size, float height_threshold, float max_slope, float max_window){
+    const std::vector<pcl::PointXYZ, Eigen::aligned_allocator<pcl::PointXYZ>> &points = cloud->points;
+    ground_cloud->clear();
+    obstacle_cloud->clear();
+    if(points.empty()){
+      return;
+    }
+    
+    float x_min = points[0].x;
+    float y_min = points[0].y;
+    float x_max = points[0].x;
+    float y_max = points[0].y;
+    for(unsigned i = 1; i < points.size(); i++){
+      x_min = std::min(x_min, points[i].x);
+      y_min = std::min(y_min, points[i].y);
+      x_max = std::max(x_max, points[i].x);
+      y_max = std::max(y_max, points[i].y);
+    }
+    
+    const int cols = (int)((x_max - x_min) / cell_size) + 1;
+    const int rows = (int)((y_max - y_min) / cell_size) + 1;
+    const unsigned num_cells = rows*cols;
+    const float empty = std::numeric_limits<float>::infinity();
+    
+    ThreadPool &pool = *pool_;
+    const unsigned num_chunks = pool.getNumThreads();
+    const unsigned chunk_size = (points.size() + num_chunks - 1) / num_chunks;
+    
+    //Pass 1. Lowest point in each cell, all chunks writing one shared grid.
+    //Two chunks rarely hit the same cell at once, so the compare and swap almost never retries.
+    std::vector<unsigned> cell_of_point(points.size());
+    std::vector<std::atomic<float>> shared_min(num_cells);
+    pool.parallelFor(rows, [&](unsigned r, unsigned worker){
+      for(int c = 0; c < cols; c++){
+        shared_min[(r*cols) + c].store(empty, std::memory_order_relaxed);
+      }
+    });
+    pool.parallelFor(num_chunks, [&](unsigned chunk, unsigned worker){
+      unsigned end = std::min((unsigned)points.size(), (chunk+1)*chunk_size);
+      for(unsigned i = chunk*chunk_size; i < end; i++){
+        int c = (int)((points[i].x - x_min) / cell_size);
+        int r = (int)((points[i].y - y_min) / cell_size);
+        unsigned cell = (r*cols) + c;
+        cell_of_point[i] = cell;
+        
+        float lowest = shared_min[cell].load(std::memory_order_relaxed);
+        while(points[i].z < lowest && !shared_min[cell].compare_exchange_weak(lowest, points[i].z, std::memory_order_relaxed)){}
+      }
+    });
+    
+    std::vector<float> cell_min(num_cells);
+    pool.parallelFor(rows, [&](unsigned r, unsigned worker){
+      for(int c = 0; c < cols; c++){
+        cell_min[(r*cols) + c] = shared_min[(r*cols) + c].load(std::memory_order_relaxed);
+      }
+    });
+    shared_min = std::vector<std::atomic<float>>();
+    
+    //Pass 2. Progressive opening. Separable min then max filters, rows in parallel.
+    std::vector<float> surface(cell_min);
+    std::vector<float> temp(num_cells);
+    std::vector<unsigned char> is_ground_cell(num_cells, 1);
+    
+    //window is the half width. The full window is 2*window+1 cells and max_window limits the full width.
+    int max_half_window = std::max(1, (int)(max_window / cell_size) / 2);
+    int prev_window = 0;
+    for(int window = 1; window <= max_half_window; window *= 2){
+      //erosion. Empty cells are infinite so they never win.
+      pool.parallelFor(rows, [&](unsigned r, unsigned worker){
+        for(int c = 0; c < cols; c++){
+          float lowest = empty;
+          for(int k = std::max(0, c-window); k <= std::min(cols-1, c+window); k++){
+            lowest = std::min(lowest, surface[(r*cols) + k]);
+          }
+          temp[(r*cols) + c] = lowest;
+        }
+      });
+      pool.parallelFor(rows, [&](unsigned r, unsigned worker){
+        for(int c = 0; c < cols; c++){
+          float lowest = empty;
+          for(int k = std::max(0, (int)r-window); k <= std::min(rows-1, (int)r+window); k++){
+            lowest = std::min(lowest, temp[(k*cols) + c]);
+          }
+          surface[(r*cols) + c] = lowest;
+        }
+      });
+      
+      //dilation. Empty cells are skipped so they don't spread.
+      pool.parallelFor(rows, [&](unsigned r, unsigned worker){
+        for(int c = 0; c < cols; c++){
+          float highest = -empty;
+          for(int k = std::max(0, c-window); k <= std::min(cols-1, c+window); k++){
+            float val = surface[(r*cols) + k];
+            if(val != empty){
+              highest = std::max(highest, val);
+            }
+          }
+          temp[(r*cols) + c] = highest;
+        }
+      });
+      pool.parallelFor(rows, [&](unsigned r, unsigned worker){
+        for(int c = 0; c < cols; c++){
+          float highest = -empty;
+          for(int k = std::max(0, (int)r-window); k <= std::min(rows-1, (int)r+window); k++){
+            highest = std::max(highest, temp[(k*cols) + c]);
+          }
+          unsigned cell = (r*cols) + c;
+          surface[cell] = (cell_min[cell] == empty) ? empty : highest;
+          
+          //slope allowance grows with the full window width, (2w+1) - (2w_prev+1)
+          float dh = height_threshold + (max_slope*2*(window - prev_window)*cell_size);
+          if(cell_min[cell] != empty && (cell_min[cell] - surface[cell]) > dh){
+            is_ground_cell[cell] = 0;
+          }
+        }
+      });
+      
+      prev_window = window;
+    }
+    
+    //Pass 3. Label points.
+    std::vector<unsigned char> is_ground(points.size());
+    pool.parallelFor(num_chunks, [&](unsigned chunk, unsigned worker){
+      unsigned end = std::min((unsigned)points.size(), (chunk+1)*chunk_size);
+      for(unsigned i = chunk*chunk_size; i < end; i++){
+        unsigned cell = cell_of_point[i];
+        is_ground[i] = is_ground_cell[cell] && ((points[i].z - surface[cell]) <= height_threshold);
+      }
+    });
+    
+    for(unsigned i = 0; i < points.size(); i++){
+      if(is_ground[i]){
+        ground_cloud->points.push_back(points[i]);
+      }
+      else{
+        obstacle_cloud->points.push_back(points[i]);
+      }
+    }
+    ground_cloud->width = ground_cloud->points.size();
+    ground_cloud->height = 1;
+    obstacle_cloud->width = obstacle_cloud->points.size();
+    obstacle_cloud->height = 1;
+    
+    ROS_INFO("Grid segmentation: %lu ground points  %lu obstacle points", ground_cloud->points.size(), obstacle_cloud->points.size());
+}
+
 //takes uninflated costmap
 void OctoTerrainMap::computeInflationGrid(float *costmap, float *inflated_costmap){    
     float robot_radius;
@@ -392,19 +919,169 @@ void OctoTerrainMap::computeInflationGrid(float *costmap, float *inflated_costma
     delete robot_cells;
 }
 
+//Two phases. Cells with ground points within elevation_support_cells get the KNN
+//average. Everything else, mostly the padding computePclOriginSize adds, is
+//filled by fillHoles and flagged in unobserved_.
 void OctoTerrainMap::computeElevationGrid(float *temp_elev_map){
-    unsigned offset;
-    float elev_guess = 0;
+    //In cells so it follows elevation_map_res. Anything past the 10m padding would never mark a cell.
+    int support_cells = 1;
+    private_nh_->getParam("/TerrainMap/elevation_support_cells", support_cells);
+    support_cells = std::max(support_cells, 0);
+    
     ROS_INFO("Begin precomputing elevation grid");
+    
+    //Bin ground points to their nearest grid sample.
+    std::vector<unsigned char> has_point(rows_*cols_, 0);
+    for(unsigned i = 0; i < pcl_cloud.points.size(); i++){
+        int mx = (int)(((pcl_cloud.points[i].x - x_origin_) / map_res_) + .5f);
+        int my = (int)(((pcl_cloud.points[i].y - y_origin_) / map_res_) + .5f);
+        if(mx >= 0 && mx < (int)cols_ && my >= 0 && my < (int)rows_){
+            has_point[(my*cols_) + mx] = 1;
+        }
+    }
+    
+    //Support is the binned points dilated by support_cells. Separable, rows then columns.
+    std::vector<unsigned char> row_support(rows_*cols_, 0);
     for(unsigned y = 0; y < rows_; y++){
-        offset = y*cols_;
+        int last_point = -1 - support_cells; //column of the most recent point to the left
+        for(int x = 0; x < (int)cols_; x++){
+            if(has_point[(y*cols_) + x]) last_point = x;
+            row_support[(y*cols_) + x] = (x - last_point) <= support_cells;
+        }
+        last_point = cols_ + support_cells;
+        for(int x = cols_-1; x >= 0; x--){
+            if(has_point[(y*cols_) + x]) last_point = x;
+            row_support[(y*cols_) + x] |= (last_point - x) <= support_cells;
+        }
+    }
+    for(unsigned x = 0; x < cols_; x++){
+        int last_point = -1 - support_cells;
+        for(int y = 0; y < (int)rows_; y++){
+            if(row_support[(y*cols_) + x]) last_point = y;
+            unobserved_[(y*cols_) + x] = (y - last_point) > support_cells;
+        }
+        last_point = rows_ + support_cells;
+        for(int y = rows_-1; y >= 0; y--){
+            if(row_support[(y*cols_) + x]) last_point = y;
+            unobserved_[(y*cols_) + x] &= (last_point - y) > support_cells;
+        }
+    }
+    
+    //KNN average on supported cells only. kdtree searches are read only, so rows go in parallel.
+    ThreadPool &pool = *pool_;
+    pool.parallelFor(rows_, [&](unsigned y, unsigned worker){
+        unsigned offset = y*cols_;
         for(unsigned x = 0; x < cols_; x++){
-            temp_elev_map[offset + x] = averageNeighbors(x_origin_+(x*map_res_), y_origin_+(y*map_res_), elev_guess);
-            elev_guess = temp_elev_map[offset + x];
+            if(!unobserved_[offset + x]){
+                temp_elev_map[offset + x] = averageNeighbors(x_origin_+(x*map_res_), y_origin_+(y*map_res_), 0);
+            }
+        }
+    });
+    
+    unsigned num_unobserved = 0;
+    for(unsigned i = 0; i < rows_*cols_; i++){
+        num_unobserved += unobserved_[i];
+    }
+    ROS_INFO("%u of %u cells have no support, filling them in", num_unobserved, rows_*cols_);
+    
+    fillHoles(temp_elev_map, unobserved_);
+}
+
+//Push-pull interpolation. Push averages known cells down a pyramid of 2x2 blocks,
+//pull walks back up and gives every hole its parent's value, blended by how much
+//of the hole was known. Linear in the number of cells.
+void OctoTerrainMap::fillHoles(float *grid, const unsigned char *holes){
+    std::vector<std::vector<float>> values(1);
+    std::vector<std::vector<float>> weights(1);
+    std::vector<unsigned> level_rows(1, rows_);
+    std::vector<unsigned> level_cols(1, cols_);
+    
+    values[0].resize(rows_*cols_);
+    weights[0].resize(rows_*cols_);
+    unsigned num_holes = 0;
+    for(unsigned i = 0; i < rows_*cols_; i++){
+        weights[0][i] = holes[i] ? 0 : 1;
+        values[0][i] = holes[i] ? 0 : grid[i];
+        num_holes += holes[i];
+    }
+    if(num_holes == 0 || num_holes == rows_*cols_){
+        if(num_holes){
+            memset(grid, 0, rows_*cols_*sizeof(float));
+        }
+        return;
+    }
+    
+    //push
+    while(level_rows.back() > 1 || level_cols.back() > 1){
+        unsigned fine_rows = level_rows.back();
+        unsigned fine_cols = level_cols.back();
+        unsigned coarse_rows = (fine_rows + 1) / 2;
+        unsigned coarse_cols = (fine_cols + 1) / 2;
+        
+        std::vector<float> coarse_values(coarse_rows*coarse_cols, 0);
+        std::vector<float> coarse_weights(coarse_rows*coarse_cols, 0);
+        const std::vector<float> &fine_values = values.back();
+        const std::vector<float> &fine_weights = weights.back();
+        
+        for(unsigned y = 0; y < fine_rows; y++){
+            for(unsigned x = 0; x < fine_cols; x++){
+                unsigned fine_idx = (y*fine_cols) + x;
+                unsigned coarse_idx = ((y/2)*coarse_cols) + (x/2);
+                coarse_values[coarse_idx] += fine_weights[fine_idx]*fine_values[fine_idx];
+                coarse_weights[coarse_idx] += fine_weights[fine_idx];
+            }
+        }
+        for(unsigned i = 0; i < coarse_rows*coarse_cols; i++){
+            if(coarse_weights[i] > 0){
+                coarse_values[i] /= coarse_weights[i];
+            }
+            coarse_weights[i] = std::min(coarse_weights[i], 1.0f);
+        }
+        
+        values.push_back(coarse_values);
+        weights.push_back(coarse_weights);
+        level_rows.push_back(coarse_rows);
+        level_cols.push_back(coarse_cols);
+    }
+    
+    //pull
+    for(int level = (int)values.size() - 2; level >= 0; level--){
+        unsigned fine_cols = level_cols[level];
+        unsigned coarse_cols = level_cols[level+1];
+        std::vector<float> &fine_values = values[level];
+        std::vector<float> &fine_weights = weights[level];
+        const std::vector<float> &coarse_values = values[level+1];
+        
+        for(unsigned y = 0; y < level_rows[level]; y++){
+            for(unsigned x = 0; x < fine_cols; x++){
+                unsigned fine_idx = (y*fine_cols) + x;
+                float w = fine_weights[fine_idx];
+                if(w < 1){
+                    fine_values[fine_idx] = (w*fine_values[fine_idx]) + ((1-w)*coarse_values[((y/2)*coarse_cols) + (x/2)]);
+                    fine_weights[fine_idx] = 1;
+                }
+            }
+        }
+    }
+    
+    for(unsigned i = 0; i < rows_*cols_; i++){
+        if(holes[i]){
+            grid[i] = values[0][i];
         }
     }
 }
 
+//0 where the elevation was made up by fillHoles.
+int OctoTerrainMap::isObserved(float x, float y) const{
+    if(!unobserved_ || x < x_origin_ || x > x_max_ || y < y_origin_ || y > y_max_){
+      return 0;
+    }
+    
+    unsigned mx = std::min((unsigned)(((x - x_origin_) / map_res_) + .5f), cols_-1);
+    unsigned my = std::min((unsigned)(((y - y_origin_) / map_res_) + .5f), rows_-1);
+    return !unobserved_[(my*cols_) + mx];
+}
+
 //I really don't like how the costmap_2d is working.
 //RTabMap doesn't really give me a choice over how the global map is generated
 void OctoTerrainMap::computeOccupancyGrid(pcl::PointCloud<pcl::PointXYZ>::Ptr obstacle_cloud, float* temp_occ_grid){
@@ -460,10 +1137,332 @@ void OctoTerrainMap::computeOccupancyGrid(pcl::PointCloud<pcl::PointXYZ>::Ptr ob
     }
 }
 
+//Distance from the ground up to the lowest occupied voxel over a cell.
+//max_clearance_ means nothing was found.
+void OctoTerrainMap::computeClearance(unsigned idx){
+    unsigned row = idx / cols_;
+    unsigned col = idx % cols_;
+    float x = (col*map_res_) + x_origin_;
+    float y = (row*map_res_) + y_origin_;
+    float ground = elev_map_[idx];
+    
+    octomap::point3d bbx_min(x - .5f*map_res_, y - .5f*map_res_, ground - max_clearance_);
+    octomap::point3d bbx_max(x + .5f*map_res_, y + .5f*map_res_, ground + max_clearance_);
+    
+    float lowest = ground + max_clearance_;
+    for(octomap::OcTree::leaf_bbx_iterator it = octomap_->begin_leafs_bbx(bbx_min, bbx_max), end = octomap_->end_leafs_bbx(); it != end; ++it){
+      if(octomap_->isNodeOccupied(*it)){
+        lowest = std::min(lowest, (float)(it.getZ() - .5*it.getSize()));
+      }
+    }
+    
+    clearance_map_[idx] = std::max(lowest - ground, 0.0f);
+}
+
+//Adds newly seen obstacle points to the octree and refreshes the clearance of
+//only the columns they land in. Cloud maps do that through refilter, which
+//covers the touched cells, DEM maps have no raw layers and do it here.
+void OctoTerrainMap::insertObstaclePoints(const pcl::PointCloud<pcl::PointXYZ> &obstacle_cloud){
+    std::vector<unsigned> touched;
+    touched.reserve(obstacle_cloud.points.size());
+    
+    for(unsigned i = 0; i < obstacle_cloud.points.size(); i++){
+      const pcl::PointXYZ &pt = obstacle_cloud.points[i];
+      if(pt.x < x_origin_ || pt.x > x_max_ || pt.y < y_origin_ || pt.y > y_max_){
+        continue;
+      }
+      
+      octomap_->updateNode(octomap::point3d(pt.x, pt.y, pt.z), true, true);
+      
+      unsigned mx = std::min((unsigned)(((pt.x - x_origin_) / map_res_) + .5f), cols_-1);
+      unsigned my = std::min((unsigned)(((pt.y - y_origin_) / map_res_) + .5f), rows_-1);
+      touched.push_back((my*cols_) + mx);
+      
+      //Same count computeOccupancyGrid makes, capped at its 16 nearest neighbors.
+      if(raw_occ_grid_){
+        unsigned idx = (my*cols_) + mx;
+        raw_occ_grid_[idx] = std::min(raw_occ_grid_[idx] + 1.0f, 16.0f);
+        markDirty(my, mx, my, mx);
+      }
+    }
+    octomap_->updateInnerOccupancy();
+    revision_++;
+    
+    if(raw_occ_grid_){
+      refilter();
+      return;
+    }
+    
+    std::sort(touched.begin(), touched.end());
+    touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+    for(unsigned i = 0; i < touched.size(); i++){
+      computeClearance(touched[i]);
+    }
+    
+    if(!touched.empty()){
+      unsigned min_row = rows_;
+      unsigned min_col = cols_;
+      unsigned max_row = 0;
+      unsigned max_col = 0;
+      for(unsigned i = 0; i < touched.size(); i++){
+        min_row = std::min(min_row, touched[i] / cols_);
+        max_row = std::max(max_row, touched[i] / cols_);
+        min_col = std::min(min_col, touched[i] % cols_);
+        max_col = std::max(max_col, touched[i] % cols_);
+      }
+      updateOccupancyBits(min_row, min_col, max_row, max_col);
+    }
+}
+
+//Grows the dirty rectangle to include rows min_row..max_row and cols min_col..max_col.
+void OctoTerrainMap::markDirty(unsigned min_row, unsigned min_col, unsigned max_row, unsigned max_col){
+    if(!is_dirty_){
+      dirty_min_row_ = min_row;
+      dirty_min_col_ = min_col;
+      dirty_max_row_ = max_row;
+      dirty_max_col_ = max_col;
+      is_dirty_ = 1;
+      return;
+    }
+    
+    dirty_min_row_ = std::min(dirty_min_row_, min_row);
+    dirty_min_col_ = std::min(dirty_min_col_, min_col);
+    dirty_max_row_ = std::max(dirty_max_row_, max_row);
+    dirty_max_col_ = std::max(dirty_max_col_, max_col);
+}
+
+int OctoTerrainMap::setRawElevation(unsigned row, unsigned col, float z){
+    if(!raw_elev_map_){
+      ROS_INFO("setRawElevation: DEM maps have no unfiltered elevation layer");
+      return 0;
+    }
+    raw_elev_map_[(row*cols_) + col] = z;
+    markDirty(row, col, row, col);
+    return 1;
+}
+
+int OctoTerrainMap::setRawOccupancy(unsigned row, unsigned col, float occ){
+    if(!raw_occ_grid_){
+      ROS_INFO("setRawOccupancy: DEM maps have no unfiltered occupancy layer");
+      return 0;
+    }
+    raw_occ_grid_[(row*cols_) + col] = occ;
+    markDirty(row, col, row, col);
+    return 1;
+}
+
+//Every blurred cell within a kernel radius of a dirty raw cell changed, so only
+//that halo gets recomputed. Clearance is measured from the blurred ground, so it
+//follows the same region.
+void OctoTerrainMap::refilter(){
+    if(!is_dirty_ || !raw_occ_grid_){
+      return;
+    }
+    
+    unsigned min_row = (dirty_min_row_ > (unsigned)kernel_size_) ? (dirty_min_row_ - kernel_size_) : 0;
+    unsigned min_col = (dirty_min_col_ > (unsigned)kernel_size_) ? (dirty_min_col_ - kernel_size_) : 0;
+    unsigned max_row = std::min(dirty_max_row_ + kernel_size_, rows_-1);
+    unsigned max_col = std::min(dirty_max_col_ + kernel_size_, cols_-1);
+    
+    blurRegion(min_row, min_col, max_row, max_col);
+    for(unsigned i = min_row; i <= max_row; i++){
+      for(unsigned j = min_col; j <= max_col; j++){
+        computeClearance((i*cols_) + j);
+      }
+    }
+    updateOccupancyBits(min_row, min_col, max_row, max_col);
+    
+    is_dirty_ = 0;
+    revision_++;
+}
+
+//A cell is blocked when isStateValid would reject it. One bit per cell, rows padded
+//to whole words. occ_sat_ is the summed area table of the bits with a zero row and
+//column in front, so any box count is four lookups.
+//Only bits in the rectangle are recomputed. A flipped bit changes every table entry
+//below and to the right of it, so those entries get the accumulated change added:
+//the rectangle's own entries get the change so far, entries right of it get the
+//change of their row, entries below it get the change of the last rectangle row.
+//That pass is one add per entry in the bottom right of the map, and is skipped
+//when no bit flipped.
+void OctoTerrainMap::updateOccupancyBits(unsigned min_row, unsigned min_col, unsigned max_row, unsigned max_col){
+    words_per_row_ = (cols_ + 63) / 64;
+    if(!occ_bits_){
+      occ_bits_ = new uint64_t[rows_*words_per_row_];
+      occ_sat_ = new unsigned[(rows_+1)*(cols_+1)];
+      memset(occ_bits_, 0, rows_*words_per_row_*sizeof(uint64_t));
+      memset(occ_sat_, 0, (rows_+1)*(cols_+1)*sizeof(unsigned));
+    }
+    
+    const unsigned sat_cols = cols_+1;
+    const unsigned rect_cols = max_col - min_col + 1;
+    std::vector<int> delta(rect_cols, 0); //change in the table entry for each rectangle column, summed over the rows so far
+    int changed = 0;
+    
+    for(unsigned i = min_row; i <= max_row; i++){
+      uint64_t *row_bits = &occ_bits_[i*words_per_row_];
+      int row_delta = 0;
+      for(unsigned j = min_col; j <= max_col; j++){
+        unsigned idx = (i*cols_) + j;
+        uint64_t mask = 1ull << (j & 63);
+        int was_set = (row_bits[j >> 6] & mask) != 0;
+        int is_set = occ_grid_blur_[idx] > occupancy_threshold_ && clearance_map_[idx] < vehicle_height_;
+        if(is_set){
+          row_bits[j >> 6] |= mask;
+        }
+        else{
+          row_bits[j >> 6] &= ~mask;
+        }
+        row_delta += is_set - was_set;
+        delta[j - min_col] += row_delta;
+        changed |= is_set != was_set;
+      }
+      
+      if(!changed){
+        continue;
+      }
+      unsigned *sat_row = &occ_sat_[(i+1)*sat_cols];
+      for(unsigned j = min_col; j <= max_col; j++){
+        sat_row[j+1] += delta[j - min_col];
+      }
+      for(unsigned j = max_col+1; j < cols_; j++){
+        sat_row[j+1] += delta[rect_cols-1];
+      }
+    }
+    
+    if(!changed){
+      return;
+    }
+    for(unsigned i = max_row+1; i < rows_; i++){
+      unsigned *sat_row = &occ_sat_[(i+1)*sat_cols];
+      for(unsigned j = min_col; j <= max_col; j++){
+        sat_row[j+1] += delta[j - min_col];
+      }
+      for(unsigned j = max_col+1; j < cols_; j++){
+        sat_row[j+1] += delta[rect_cols-1];
+      }
+    }
+}
+
+//Blocked cells in rows min_row..max_row and cols min_col..max_col. Clamped to the map.
+unsigned OctoTerrainMap::countOccupied(unsigned min_row, unsigned min_col, unsigned max_row, unsigned max_col) const{
+    max_row = std::min(max_row, rows_-1);
+    max_col = std::min(max_col, cols_-1);
+    if(min_row > max_row || min_col > max_col){
+      return 0;
+    }
+    
+    const unsigned sat_cols = cols_+1;
+    return occ_sat_[((max_row+1)*sat_cols) + max_col+1]
+         - occ_sat_[(min_row*sat_cols) + max_col+1]
+         - occ_sat_[((max_row+1)*sat_cols) + min_col]
+         + occ_sat_[(min_row*sat_cols) + min_col];
+}
+
+//Same cells isStateValid would test for every point in the box.
+unsigned OctoTerrainMap::countOccupied(float min_x, float min_y, float max_x, float max_y) const{
+    float col_lo = std::max(((min_x - x_origin_) / map_res_) + .5f, 0.0f);
+    float row_lo = std::max(((min_y - y_origin_) / map_res_) + .5f, 0.0f);
+    float col_hi = ((max_x - x_origin_) / map_res_) + .5f;
+    float row_hi = ((max_y - y_origin_) / map_res_) + .5f;
+    if(col_hi < 0 || row_hi < 0){
+      return 0;
+    }
+    
+    return countOccupied((unsigned)row_lo, (unsigned)col_lo, (unsigned)row_hi, (unsigned)col_hi);
+}
+
+void OctoTerrainMap::initBlurKernel(){
+    kernel_size_ = 10;
+    float sigma_sq = 50;
+    int side_len = (2*kernel_size_)+1;
+    float dist_sq;
+    
+    blur_kernel_ = new float[side_len*side_len];
+    for(int i = 0; i < side_len; i++){
+      for(int j = 0; j < side_len; j++){
+        int dx = j - kernel_size_;
+        int dy = i - kernel_size_;
+        dist_sq = (dx*dx) + (dy*dy);
+        blur_kernel_[(i*side_len)+j] = expf(-.5f*dist_sq/sigma_sq);
+      }
+    }
+}
+
+//Gaussian blur of the raw layers into occ_grid_blur_ and elev_map_, for cells in
+//rows min_row..max_row and cols min_col..max_col only.
+void OctoTerrainMap::blurRegion(unsigned min_row, unsigned min_col, unsigned max_row, unsigned max_col){
+    const int kernel_size = kernel_size_;
+    int side_len = (2*kernel_size)+1;
+    
+    for(int i = min_row; i <= (int)max_row; i++){
+      for(int j = min_col; j <= (int)max_col; j++){
+        
+        float weight;
+        float total_weight = 0;
+        float occ_sum = 0;
+        float elev_sum = 0;
+        
+        for(int k = std::max((int)0,(int)(i-kernel_size)); k <= std::min((int)(rows_-1),(int)(i+kernel_size)); k++){
+            int dy = k - i + kernel_size;
+            unsigned kernel_idx_row = dy*side_len;
+            for(int m = std::max((int)0,int(j-kernel_size)); m <= std::min(int(cols_-1),int(j+kernel_size)); m++){
+                int dx = m - j + kernel_size;
+                
+                weight = blur_kernel_[kernel_idx_row + dx];
+                occ_sum += weight*raw_occ_grid_[(k*cols_) + m];
+                elev_sum += weight*raw_elev_map_[(k*cols_) + m];
+                total_weight += weight;
+            }
+        }
+        
+        occ_grid_blur_[(i*cols_) + j] = occ_sum / total_weight;
+        elev_map_[(i*cols_) + j] = (elev_sum / total_weight);
+      }
+    }
+}
+
 float OctoTerrainMap::getMapRes(){
     return map_res_;
 }
 
+//Bytes held by the grids and the octree.
+size_t OctoTerrainMap::getMemoryUsage() const{
+    size_t num_grids = (elev_map_ != NULL) + (occ_grid_blur_ != NULL) + (clearance_map_ != NULL) +
+                       (raw_elev_map_ != NULL) + (raw_occ_grid_ != NULL);
+    size_t total = num_grids*rows_*cols_*sizeof(float);
+    if(unobserved_){
+      total += rows_*cols_;
+    }
+    if(occ_bits_){
+      total += rows_*words_per_row_*sizeof(uint64_t) + (rows_+1)*(cols_+1)*sizeof(unsigned);
+    }
+    if(octomap_){
+      total += octomap_->memoryUsage();
+    }
+    return total;
+}
+
+
+//Same padding as computePclOriginSize, with every grid allocated.
+size_t OctoTerrainMap::estimateMemoryUsage(float width, float height){
+    float res = 1;
+    ros::param::get("/TerrainMap/elevation_map_res", res);
+    size_t cols = (size_t) ceilf((width + 20) / res);
+    size_t rows = (size_t) ceilf((height + 20) / res);
+    size_t words_per_row = (cols + 63) / 64;
+    return (5*rows*cols*sizeof(float)) + (rows*cols) + (rows*words_per_row*sizeof(uint64_t)) + ((rows+1)*(cols+1)*sizeof(unsigned));
+}
+
+//The kd tree keeps its input cloud alive and FLANN copies the points into its own index.
+size_t OctoTerrainMap::getSharedMemoryUsage(){
+    size_t total = pcl_cloud.points.capacity()*sizeof(pcl::PointXYZ);
+    pcl::PointCloud<pcl::PointXYZ>::ConstPtr tree_cloud = kdtree.getInputCloud();
+    if(tree_cloud){
+      total += tree_cloud->points.size()*(sizeof(pcl::PointXYZ) + (3*sizeof(float)) + sizeof(int));
+    }
+    return total;
+}
 
 void OctoTerrainMap::getBounds(float &max_x, float &min_x, float &max_y, float &min_y) const{
   max_x = x_max_; //(cols_*map_res_) + x_origin_;
@@ -586,25 +1585,19 @@ float OctoTerrainMap::averageNeighbors(float x, float y, float z_guess) const{
 
 int OctoTerrainMap::isStateValid(float x, float y) const{
     //look up in the oc_grid_ to see if thing is occupied
-    unsigned mx;
-    unsigned my;
-    
-    //might not need this conversion.
-    /*
-    if(!occ_grid_->worldToMap(x, y, mx, my)){
-      ROS_INFO("worldToMap OOB");
-      return 0; //Out of Bounds
-    }
-    */
     if(x < x_origin_ || x > x_max_ || y < y_origin_ || y > y_max_){
       ROS_INFO("Out of bounds of elevation map x: %f-%f   y: %f-%f,   <%f %f>", x_origin_, x_max_, y_origin_, y_max_,  x, y);
       return 0;
     }
     
+    //grids are sampled at the cell corners, so take the nearest sample.
+    unsigned mx = std::min((unsigned)(((x - x_origin_) / map_res_) + .5f), cols_-1);
+    unsigned my = std::min((unsigned)(((y - y_origin_) / map_res_) + .5f), rows_-1);
     
-    if(occ_grid_blur_[(my*cols_) + mx] > occupancy_threshold_){
+    //Obstacles the vehicle fits under (canopy, overhangs) don't count. That is folded into the bit.
+    if(reject_occupied_ && ((occ_bits_[(my*words_per_row_) + (mx >> 6)] >> (mx & 63)) & 1)){
       //ROS_INFO("Lethal Obstacle Detected");
-      //return 0; //state is occupied if occupancy > 50%. At least I think thats how it all works.
+      return 0;
     }
     
     //ROS_INFO("Returning true from OctoTerrainMap::isStateValid");
@@ -5,6 +5,7 @@
 #include <ros/ros.h>
 #include "PlannerVisualizer.h"
 #include "JackalStatePropagator.h"
+#include "VehicleModelStateSpace.h"
 #include "TerrainMap.h"
 #include <unistd.h>
 
@@ -240,7 +241,8 @@ void PlannerVisualizer::drawSubTree(const ompl::base::PlannerData &planner_data,
   }
   
   const ompl::base::State *state = vertex.getState();
-  const ompl::base::RealVectorStateSpace::StateType& state_vector = *state->as<ompl::base::RealVectorStateSpace::StateType>();
+  double state_vector[7];
+  auvsl::getVehiclePose(sic_->getStateSpace().get(), state, state_vector);
   
   std::vector<unsigned> edge_list;
   unsigned num_edges = planner_data.getEdges(v_idx, edge_list);
@@ -252,7 +254,8 @@ void PlannerVisualizer::drawSubTree(const ompl::base::PlannerData &planner_data,
     
     const ompl::base::PlannerDataVertex &next_vertex = planner_data.getVertex(next_v_idx);
     const ompl::base::State *next_state = next_vertex.getState();
-    const ompl::base::RealVectorStateSpace::StateType& next_state_vector = *next_state->as<ompl::base::RealVectorStateSpace::StateType>();
+    double next_state_vector[7];
+    auvsl::getVehiclePose(sic_->getStateSpace().get(), next_state, next_state_vector);
     
     geometry_msgs::Point parent_point;
     geometry_msgs::Point child_point;
@@ -0,0 +1,156 @@
+#include "PropagationCache.h"
+
+#include <ros/ros.h>
+
+#include <string.h>
+#include <math.h>
+
+
+
+PropagationCache::PropagationCache(size_t capacity){
+  ros::NodeHandle nh;
+  position_quantum_ = 0;
+  orientation_quantum_ = 0;
+  velocity_quantum_ = 0;
+  control_quantum_ = 0;
+  max_terrain_delta_ = .02;
+  terrain_map_ = NULL;
+  nh.getParam("/PropagationCache/position_quantum", position_quantum_);
+  nh.getParam("/PropagationCache/orientation_quantum", orientation_quantum_);
+  nh.getParam("/PropagationCache/velocity_quantum", velocity_quantum_);
+  nh.getParam("/PropagationCache/control_quantum", control_quantum_);
+  nh.getParam("/PropagationCache/max_terrain_delta", max_terrain_delta_);
+  
+  capacity_ = capacity;
+  index_.reserve(capacity_);
+  num_hits_ = 0;
+  num_misses_ = 0;
+  num_evictions_ = 0;
+  
+  ROS_INFO("PropagationCache %lu entries, quanta: position %f orientation %f velocity %f control %f",
+           capacity_, position_quantum_, orientation_quantum_, velocity_quantum_, control_quantum_);
+}
+
+size_t PropagationCache::KeyHash::operator()(const Key &key) const{
+  //FNV-1a over the key bytes
+  uint64_t hash = 14695981039346656037ULL;
+  const unsigned char *bytes = (const unsigned char*) key.data();
+  for(size_t i = 0; i < sizeof(int64_t)*KEY_LEN; i++){
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+int64_t PropagationCache::quantize(double value, double quantum){
+  if(quantum <= 0){
+    if(value == 0){
+      value = 0; //-0 and 0 should match
+    }
+    int64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+  }
+  return (int64_t) floor((value / quantum) + .5);
+}
+
+void PropagationCache::makeKey(const double *start, const double *control, double duration, Key &key) const{
+  for(int i = 0; i < 3; i++){
+    key[i] = quantize(start[i], position_quantum_);
+  }
+  for(int i = 3; i < 7; i++){
+    key[i] = quantize(start[i], orientation_quantum_);
+  }
+  for(int i = 7; i < STATE_LEN; i++){
+    key[i] = quantize(start[i], velocity_quantum_);
+  }
+  key[STATE_LEN] = quantize(control[0], control_quantum_);
+  key[STATE_LEN+1] = quantize(control[1], control_quantum_);
+  key[STATE_LEN+2] = quantize(duration, 0);
+}
+
+int PropagationCache::lookup(const double *start, const double *control, double duration, double *result){
+  Key key;
+  makeKey(start, control, duration, key);
+  
+  double dx, dy;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if(it == index_.end()){
+      num_misses_++;
+      return 0;
+    }
+    
+    entries_.splice(entries_.begin(), entries_, it->second);
+    const Entry &entry = *it->second;
+    memcpy(result, entry.result, sizeof(double)*STATE_LEN);
+    dx = start[0] - entry.start_pos[0];
+    dy = start[1] - entry.start_pos[1];
+  }
+  
+  //Terrain lookups happen outside the lock, result is this thread's copy.
+  if(dx != 0 || dy != 0){
+    if(!terrain_map_){
+      num_misses_++;
+      return 0;
+    }
+    double cached_alt = terrain_map_->getAltitude(result[0], result[1], result[2]);
+    double shifted_alt = terrain_map_->getAltitude(result[0] + dx, result[1] + dy, result[2]);
+    if(fabs(shifted_alt - cached_alt) > max_terrain_delta_){
+      num_misses_++;
+      return 0;
+    }
+    result[0] += dx;
+    result[1] += dy;
+    result[2] += shifted_alt - cached_alt;
+  }
+  num_hits_++;
+  return 1;
+}
+
+void PropagationCache::insert(const double *start, const double *control, double duration, const double *result){
+  if(capacity_ == 0){
+    return;
+  }
+  
+  Key key;
+  makeKey(start, control, duration, key);
+  
+  std::lock_guard<std::mutex> lock(mutex_);
+  if(index_.find(key) != index_.end()){ //another thread got here first
+    return;
+  }
+  
+  if(entries_.size() >= capacity_){
+    index_.erase(entries_.back().key);
+    entries_.pop_back();
+    num_evictions_++;
+  }
+  
+  entries_.emplace_front();
+  Entry &entry = entries_.front();
+  entry.key = key;
+  memcpy(entry.start_pos, start, sizeof(double)*2);
+  memcpy(entry.result, result, sizeof(double)*STATE_LEN);
+  index_[key] = entries_.begin();
+}
+
+void PropagationCache::clear(){
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  index_.clear();
+}
+
+size_t PropagationCache::size(){
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+void PropagationCache::printStats(){
+  unsigned long hits = num_hits_;
+  unsigned long misses = num_misses_;
+  float hit_rate = (hits + misses) ? (100.0f*hits / (hits + misses)) : 0;
+  ROS_INFO("PropagationCache hits %lu   misses %lu   hit rate %.1f%%   evictions %lu   size %lu",
+           hits, misses, hit_rate, (unsigned long) num_evictions_, size());
+}
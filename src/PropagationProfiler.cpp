@@ -0,0 +1,177 @@
+#include "PropagationProfiler.h"
+
+#include <ros/ros.h>
+
+#include <time.h>
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+
+unsigned PropagationProfiler::sample_interval_ = 64;
+
+//Live threads' counters, and what threads that already exited had counted.
+static std::mutex registry_mutex;
+static std::vector<PropagationProfiler::Counters*> registry;
+static PropagationProfiler::Snapshot retired = {};
+
+static double getMonotonicTime(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec*1e-9);
+}
+
+//Reference point for calibrating the cycle counter. Taken at load time, so the
+//calibration interval is however long the process has been running.
+static const uint64_t start_tsc = PropagationProfiler::readTsc();
+static const double start_time = getMonotonicTime();
+
+
+
+PropagationProfiler::Counters::Counters(){
+  clear();
+  timing = false;
+  until_sample_ = 0;
+  call_start_ = 0;
+}
+
+void PropagationProfiler::Counters::clear(){
+  calls = 0;
+  timed_calls = 0;
+  solver_steps = 0;
+  altitude_queries = 0;
+  validity_checks = 0;
+  conversions = 0;
+  rejected_steps = 0;
+  primitive_hits = 0;
+  early_exits = 0;
+  solver_allocs = 0;
+  solver_inits = 0;
+  call_ticks = 0;
+  integration_ticks = 0;
+  altitude_ticks = 0;
+  validity_ticks = 0;
+}
+
+//Raw ticks are folded in here, scaled to seconds in snapshot.
+static void accumulate(const PropagationProfiler::Counters &counters, PropagationProfiler::Snapshot &snap){
+  snap.calls += counters.calls.load(std::memory_order_relaxed);
+  snap.timed_calls += counters.timed_calls.load(std::memory_order_relaxed);
+  snap.solver_steps += counters.solver_steps.load(std::memory_order_relaxed);
+  snap.altitude_queries += counters.altitude_queries.load(std::memory_order_relaxed);
+  snap.validity_checks += counters.validity_checks.load(std::memory_order_relaxed);
+  snap.conversions += counters.conversions.load(std::memory_order_relaxed);
+  snap.rejected_steps += counters.rejected_steps.load(std::memory_order_relaxed);
+  snap.primitive_hits += counters.primitive_hits.load(std::memory_order_relaxed);
+  snap.early_exits += counters.early_exits.load(std::memory_order_relaxed);
+  snap.solver_allocs += counters.solver_allocs.load(std::memory_order_relaxed);
+  snap.solver_inits += counters.solver_inits.load(std::memory_order_relaxed);
+  snap.call_seconds += counters.call_ticks.load(std::memory_order_relaxed);
+  snap.integration_seconds += counters.integration_ticks.load(std::memory_order_relaxed);
+  snap.altitude_seconds += counters.altitude_ticks.load(std::memory_order_relaxed);
+  snap.validity_seconds += counters.validity_ticks.load(std::memory_order_relaxed);
+}
+
+//Unregisters when the thread exits so snapshot never reads freed counters.
+struct PropagationProfiler::Registration{
+  Counters counters;
+
+  Registration(){
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.push_back(&counters);
+  }
+  ~Registration(){
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    accumulate(counters, retired);
+    registry.erase(std::find(registry.begin(), registry.end(), &counters));
+  }
+};
+
+PropagationProfiler::Counters& PropagationProfiler::local(){
+  thread_local Registration registration;
+  return registration.counters;
+}
+
+uint64_t PropagationProfiler::readTsc(){
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec*1000000000ull) + ts.tv_nsec;
+#endif
+}
+
+//Assumes an invariant TSC, which every x86 the planner runs on has.
+double PropagationProfiler::getTicksPerSecond(){
+  double elapsed = getMonotonicTime() - start_time;
+  if(elapsed <= 0){
+    return 1e9;
+  }
+  return (readTsc() - start_tsc) / elapsed;
+}
+
+PropagationProfiler::Snapshot PropagationProfiler::snapshot(){
+  Snapshot snap = {};
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    snap = retired;
+    for(unsigned i = 0; i < registry.size(); i++){
+      accumulate(*registry[i], snap);
+    }
+    snap.num_threads = registry.size();
+  }
+
+  double scale = 0;
+  if(snap.timed_calls > 0){
+    scale = ((double) snap.calls / snap.timed_calls) / getTicksPerSecond();
+  }
+  snap.call_seconds *= scale;
+  snap.integration_seconds *= scale;
+  snap.altitude_seconds *= scale;
+  snap.validity_seconds *= scale;
+  return snap;
+}
+
+PropagationProfiler::Snapshot PropagationProfiler::difference(const Snapshot &after, const Snapshot &before){
+  Snapshot diff;
+  diff.calls = after.calls - before.calls;
+  diff.timed_calls = after.timed_calls - before.timed_calls;
+  diff.solver_steps = after.solver_steps - before.solver_steps;
+  diff.altitude_queries = after.altitude_queries - before.altitude_queries;
+  diff.validity_checks = after.validity_checks - before.validity_checks;
+  diff.conversions = after.conversions - before.conversions;
+  diff.rejected_steps = after.rejected_steps - before.rejected_steps;
+  diff.primitive_hits = after.primitive_hits - before.primitive_hits;
+  diff.early_exits = after.early_exits - before.early_exits;
+  diff.solver_allocs = after.solver_allocs - before.solver_allocs;
+  diff.solver_inits = after.solver_inits - before.solver_inits;
+  diff.call_seconds = after.call_seconds - before.call_seconds;
+  diff.integration_seconds = after.integration_seconds - before.integration_seconds;
+  diff.altitude_seconds = after.altitude_seconds - before.altitude_seconds;
+  diff.validity_seconds = after.validity_seconds - before.validity_seconds;
+  diff.num_threads = after.num_threads;
+  return diff;
+}
+
+//Times are summed over threads, so with a batch propagator they can add up to more than solve_seconds.
+//On a single thread, solve time that isn't propagation went to sampling, nearest neighbor search and the tree.
+void PropagationProfiler::printSnapshot(const Snapshot &snap, double solve_seconds){
+  double other = snap.call_seconds - snap.integration_seconds - snap.validity_seconds;
+  ROS_INFO("RRT propagation profile over %u threads, %.3fs solve", snap.num_threads, solve_seconds);
+  ROS_INFO("  calls %lu (%lu timed)   solver steps %lu   altitude queries %lu   validity checks %lu   conversions %lu",
+           snap.calls, snap.timed_calls, snap.solver_steps, snap.altitude_queries, snap.validity_checks, snap.conversions);
+  ROS_INFO("  rejected adaptive steps %lu   primitive hits %lu   early exits %lu   solver allocs %lu   solver inits %lu",
+           snap.rejected_steps, snap.primitive_hits, snap.early_exits, snap.solver_allocs, snap.solver_inits);
+  ROS_INFO("  propagate %.3fs   integration %.3fs (altitude %.3fs)   validity %.3fs   conversion and overhead %.3fs",
+           snap.call_seconds, snap.integration_seconds, snap.altitude_seconds, snap.validity_seconds, other);
+  if(snap.calls > 0){
+    ROS_INFO("  %.2f us per call", 1e6*snap.call_seconds/snap.calls);
+  }
+}
@@ -0,0 +1,308 @@
+#include "SharedTerrainMap.h"
+
+#include <ros/ros.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+
+
+
+SharedTerrainMap::SharedTerrainMap(){
+  segment_ = NULL;
+  segment_size_ = 0;
+  header_ = NULL;
+  elev_map_ = NULL;
+  occ_grid_blur_ = NULL;
+  clearance_map_ = NULL;
+  rows_ = 0;
+  cols_ = 0;
+  revision_ = 0;
+}
+
+SharedTerrainMap::~SharedTerrainMap(){
+  detach();
+}
+
+
+
+//server side
+
+int SharedTerrainMap::publish(const OctoTerrainMap *map, const char *shm_name){
+  size_t grid_bytes = map->rows_*map->cols_*sizeof(float);
+  size_t header_bytes = (sizeof(SharedTerrainHeader) + 63) & ~((size_t) 63); //grids start cache line aligned
+  size_t segment_size = header_bytes + (3*grid_bytes);
+  
+  //Unlinking first means clients still attached to an old map keep a consistent copy.
+  markSuperseded(shm_name);
+  shm_unlink(shm_name);
+  int fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if(fd < 0){
+    ROS_INFO("SharedTerrainMap could not create %s", shm_name);
+    return 0;
+  }
+  
+  if(ftruncate(fd, segment_size) != 0){
+    ROS_INFO("SharedTerrainMap could not size %s to %lu bytes", shm_name, segment_size);
+    close(fd);
+    shm_unlink(shm_name);
+    return 0;
+  }
+  
+  void *segment = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(segment == MAP_FAILED){
+    ROS_INFO("SharedTerrainMap mmap failed for %s", shm_name);
+    shm_unlink(shm_name);
+    return 0;
+  }
+  
+  SharedTerrainHeader *header = (SharedTerrainHeader*) segment;
+  header->version = SHARED_TERRAIN_VERSION;
+  header->segment_size = segment_size;
+  header->rows = map->rows_;
+  header->cols = map->cols_;
+  header->map_res = map->map_res_;
+  header->x_origin = map->x_origin_;
+  header->y_origin = map->y_origin_;
+  header->x_max = map->x_max_;
+  header->y_max = map->y_max_;
+  header->occupancy_threshold = map->getOccupancyThreshold();
+  header->vehicle_height = map->getVehicleHeight();
+  header->elev_offset = header_bytes;
+  header->occ_offset = header_bytes + grid_bytes;
+  header->clearance_offset = header_bytes + (2*grid_bytes);
+  header->superseded = 0;
+  
+  unsigned char *base = (unsigned char*) segment;
+  memcpy(base + header->elev_offset, map->elev_map_, grid_bytes);
+  memcpy(base + header->occ_offset, map->occ_grid_blur_, grid_bytes);
+  memcpy(base + header->clearance_offset, map->clearance_map_, grid_bytes);
+  
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = SHARED_TERRAIN_MAGIC;
+  
+  munmap(segment, segment_size);
+  ROS_INFO("Published terrain map to %s, %u x %u cells, %lu bytes", shm_name, map->cols_, map->rows_, segment_size);
+  return 1;
+}
+
+void SharedTerrainMap::unpublish(const char *shm_name){
+  markSuperseded(shm_name);
+  shm_unlink(shm_name);
+}
+
+//Tells clients still mapping the old segment to refresh. Their mapping stays valid after the unlink.
+void SharedTerrainMap::markSuperseded(const char *shm_name){
+  int fd = shm_open(shm_name, O_RDWR, 0);
+  if(fd < 0){
+    return;
+  }
+  
+  struct stat seg_stat;
+  if(fstat(fd, &seg_stat) != 0 || (size_t) seg_stat.st_size < sizeof(SharedTerrainHeader)){
+    close(fd);
+    return;
+  }
+  
+  void *segment = mmap(NULL, sizeof(SharedTerrainHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(segment == MAP_FAILED){
+    return;
+  }
+  
+  SharedTerrainHeader *header = (SharedTerrainHeader*) segment;
+  if(header->magic == SHARED_TERRAIN_MAGIC && header->version == SHARED_TERRAIN_VERSION){
+    std::atomic_thread_fence(std::memory_order_release);
+    header->superseded = 1;
+  }
+  munmap(segment, sizeof(SharedTerrainHeader));
+}
+
+
+
+//client side
+
+int SharedTerrainMap::attach(const char *shm_name){
+  detach();
+  
+  int fd = shm_open(shm_name, O_RDONLY, 0);
+  if(fd < 0){
+    ROS_INFO("SharedTerrainMap %s doesn't exist. Is terrain_server_node running?", shm_name);
+    return 0;
+  }
+  
+  struct stat seg_stat;
+  if(fstat(fd, &seg_stat) != 0 || (size_t) seg_stat.st_size < sizeof(SharedTerrainHeader)){
+    ROS_INFO("SharedTerrainMap %s is too small to hold a header", shm_name);
+    close(fd);
+    return 0;
+  }
+  
+  segment_size_ = seg_stat.st_size;
+  segment_ = mmap(NULL, segment_size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(segment_ == MAP_FAILED){
+    ROS_INFO("SharedTerrainMap mmap failed for %s", shm_name);
+    segment_ = NULL;
+    return 0;
+  }
+  
+  header_ = (const SharedTerrainHeader*) segment_;
+  if(header_->magic != SHARED_TERRAIN_MAGIC){
+    ROS_INFO("SharedTerrainMap %s is not finished being written", shm_name);
+    detach();
+    return 0;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  
+  if(header_->version != SHARED_TERRAIN_VERSION){
+    ROS_INFO("SharedTerrainMap %s is version %u, expected %u", shm_name, header_->version, SHARED_TERRAIN_VERSION);
+    detach();
+    return 0;
+  }
+  
+  size_t grid_bytes = (size_t) header_->rows*header_->cols*sizeof(float);
+  size_t last_offset = std::max(header_->elev_offset, std::max(header_->occ_offset, header_->clearance_offset));
+  if(header_->segment_size != segment_size_ || (last_offset + grid_bytes) > segment_size_ || header_->rows == 0 || header_->cols == 0){
+    ROS_INFO("SharedTerrainMap %s has a bad layout", shm_name);
+    detach();
+    return 0;
+  }
+  
+  const unsigned char *base = (const unsigned char*) segment_;
+  elev_map_ = (const float*) (base + header_->elev_offset);
+  occ_grid_blur_ = (const float*) (base + header_->occ_offset);
+  clearance_map_ = (const float*) (base + header_->clearance_offset);
+  
+  rows_ = header_->rows;
+  cols_ = header_->cols;
+  map_res_ = header_->map_res;
+  x_origin_ = header_->x_origin;
+  y_origin_ = header_->y_origin;
+  
+  shm_name_ = shm_name;
+  revision_++;
+  ROS_INFO("Attached to terrain map %s, %u x %u cells", shm_name, cols_, rows_);
+  return 1;
+}
+
+//Keeps the old map if the new one can't be attached yet, e.g. it is still being written.
+int SharedTerrainMap::refresh(){
+  if(!header_ || !*((volatile const uint32_t*) &header_->superseded)){
+    return 0;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  
+  SharedTerrainMap next;
+  if(!next.attach(shm_name_.c_str())){
+    return 0;
+  }
+  
+  detach();
+  std::swap(segment_, next.segment_);
+  std::swap(segment_size_, next.segment_size_);
+  std::swap(header_, next.header_);
+  std::swap(elev_map_, next.elev_map_);
+  std::swap(occ_grid_blur_, next.occ_grid_blur_);
+  std::swap(clearance_map_, next.clearance_map_);
+  rows_ = next.rows_;
+  cols_ = next.cols_;
+  map_res_ = next.map_res_;
+  x_origin_ = next.x_origin_;
+  y_origin_ = next.y_origin_;
+  revision_++;
+  return 1;
+}
+
+void SharedTerrainMap::detach(){
+  if(segment_){
+    munmap(segment_, segment_size_);
+  }
+  segment_ = NULL;
+  segment_size_ = 0;
+  header_ = NULL;
+  elev_map_ = NULL;
+  occ_grid_blur_ = NULL;
+  clearance_map_ = NULL;
+  rows_ = 0;
+  cols_ = 0;
+}
+
+
+
+//overriden methods. Same lookups as OctoTerrainMap.
+
+BekkerData SharedTerrainMap::getSoilDataAt(float x, float y) const{
+  return lookup_soil_table(3);
+}
+
+float SharedTerrainMap::getAltitude(float x, float y, float z_guess) const{
+  float col_intrp = ((x - x_origin_) / map_res_);
+  float row_intrp = ((y - y_origin_) / map_res_);
+  
+  int oob = 0; //out of bounds
+  if(col_intrp <= 0 || col_intrp >= (cols_-1)){
+      col_intrp = std::max(std::min(col_intrp, (float)cols_-1), 0.0f);
+      oob = 1;
+  }
+  
+  if(row_intrp <= 0 || row_intrp >= (rows_-1)){
+      row_intrp = std::max(std::min(row_intrp, (float)rows_-1), 0.0f);
+      oob = 1;
+  }
+  
+  if(oob){
+    return elev_map_[(unsigned(row_intrp)*cols_) + unsigned(col_intrp)];
+  }
+  
+  unsigned col_l = floorf(col_intrp);
+  unsigned row_l = floorf(row_intrp);
+  unsigned col_u = col_l+1;
+  unsigned row_u = row_l+1;
+  
+  float z_ll = elev_map_[(row_l*cols_) + col_l];
+  float z_ul = elev_map_[(row_u*cols_) + col_l];
+  float z_lu = elev_map_[(row_l*cols_) + col_u];
+  float z_uu = elev_map_[(row_u*cols_) + col_u];
+  
+  float col_l_z = ((row_intrp - (float)row_l)*z_ul + ((float)row_u - row_intrp)*z_ll);
+  float col_r_z = ((row_intrp - (float)row_l)*z_uu + ((float)row_u - row_intrp)*z_lu);
+  
+  return ((col_intrp - (float)col_l)*col_r_z + ((float)col_u - col_intrp)*col_l_z);
+}
+
+int SharedTerrainMap::isStateValid(float x, float y) const{
+  if(x < x_origin_ || x > header_->x_max || y < y_origin_ || y > header_->y_max){
+    return 0;
+  }
+  
+  unsigned mx = std::min((unsigned)(((x - x_origin_) / map_res_) + .5f), cols_-1);
+  unsigned my = std::min((unsigned)(((y - y_origin_) / map_res_) + .5f), rows_-1);
+  unsigned idx = (my*cols_) + mx;
+  
+  if(occ_grid_blur_[idx] > header_->occupancy_threshold && clearance_map_[idx] < header_->vehicle_height){
+    return 0;
+  }
+  
+  return 1;
+}
+
+std::vector<Rectangle*> SharedTerrainMap::getObstacles() const{
+  std::vector<Rectangle*> obstacles;
+  return obstacles;
+}
+
+void SharedTerrainMap::getBounds(float &max_x, float &min_x, float &max_y, float &min_y) const{
+  max_x = header_->x_max;
+  min_x = x_origin_;
+  
+  max_y = header_->y_max;
+  min_y = y_origin_;
+}
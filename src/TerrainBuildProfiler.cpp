@@ -0,0 +1,96 @@
+#include "TerrainBuildProfiler.h"
+
+#include <ros/ros.h>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <fstream>
+
+
+
+TerrainBuildProfiler::TerrainBuildProfiler(const std::string &build_name){
+  build_name_ = build_name;
+  start_timestamp_ = (long) time(NULL);
+  stage_wall_start_ = 0;
+  stage_cpu_start_ = 0;
+}
+
+double TerrainBuildProfiler::getWallTime(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec*1e-9);
+}
+
+double TerrainBuildProfiler::getCpuTime(){
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + (ts.tv_nsec*1e-9);
+}
+
+long TerrainBuildProfiler::getPeakRssKb(){
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss; //already KB on linux
+}
+
+void TerrainBuildProfiler::begin(const char *stage, size_t input_size){
+  Stage temp;
+  temp.name = stage;
+  temp.wall_time = 0;
+  temp.cpu_time = 0;
+  temp.peak_rss_kb = 0;
+  temp.input_size = input_size;
+  temp.output_size = 0;
+  stages_.push_back(temp);
+  
+  stage_wall_start_ = getWallTime();
+  stage_cpu_start_ = getCpuTime();
+}
+
+void TerrainBuildProfiler::end(size_t output_size){
+  Stage &stage = stages_.back();
+  stage.wall_time = getWallTime() - stage_wall_start_;
+  stage.cpu_time = getCpuTime() - stage_cpu_start_;
+  stage.peak_rss_kb = getPeakRssKb();
+  stage.output_size = output_size;
+}
+
+void TerrainBuildProfiler::printSummary() const{
+  double total_wall = 0;
+  double total_cpu = 0;
+  ROS_INFO("Terrain build %s", build_name_.c_str());
+  for(unsigned i = 0; i < stages_.size(); i++){
+    const Stage &stage = stages_[i];
+    ROS_INFO("  %-20s wall %8.3fs  cpu %8.3fs  peak rss %8ld KB  in %10lu  out %10lu", stage.name.c_str(), stage.wall_time, stage.cpu_time, stage.peak_rss_kb, stage.input_size, stage.output_size);
+    total_wall += stage.wall_time;
+    total_cpu += stage.cpu_time;
+  }
+  ROS_INFO("  %-20s wall %8.3fs  cpu %8.3fs", "total", total_wall, total_cpu);
+}
+
+//Appends to report_fn, writing the column names first if the file is new.
+int TerrainBuildProfiler::writeReport(const char *report_fn) const{
+  struct stat file_stat;
+  int is_new = (stat(report_fn, &file_stat) != 0) || (file_stat.st_size == 0);
+  
+  std::ofstream report_file(report_fn, std::ofstream::out | std::ofstream::app);
+  if(!report_file.is_open()){
+    ROS_INFO("Could not open terrain build report %s", report_fn);
+    return 0;
+  }
+  
+  if(is_new){
+    report_file << "timestamp,build,stage,wall_sec,cpu_sec,peak_rss_kb,input_size,output_size\n";
+  }
+  for(unsigned i = 0; i < stages_.size(); i++){
+    const Stage &stage = stages_[i];
+    report_file << start_timestamp_ << ',' << build_name_ << ',' << stage.name << ','
+                << stage.wall_time << ',' << stage.cpu_time << ',' << stage.peak_rss_kb << ','
+                << stage.input_size << ',' << stage.output_size << '\n';
+  }
+  
+  report_file.close();
+  return 1;
+}
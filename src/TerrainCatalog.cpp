@@ -0,0 +1,155 @@
+#include "TerrainCatalog.h"
+
+#include <ros/ros.h>
+
+#include <fstream>
+#include <sstream>
+
+
+
+TerrainCatalog::TerrainCatalog(){
+  ros::NodeHandle nh;
+  float memory_budget_mb = 1024;
+  nh.getParam("/TerrainCatalog/memory_budget_mb", memory_budget_mb);
+  
+  memory_budget_ = (size_t)(memory_budget_mb*1024*1024);
+  use_counter_ = 0;
+}
+
+TerrainCatalog::~TerrainCatalog(){
+  for(unsigned i = 0; i < sites_.size(); i++){
+    delete sites_[i].map;
+  }
+}
+
+int TerrainCatalog::load(const char *catalog_fn){
+  std::ifstream catalog_file(catalog_fn);
+  if(!catalog_file.is_open()){
+    ROS_INFO("TerrainCatalog could not open %s", catalog_fn);
+    return 0;
+  }
+  
+  std::string line;
+  unsigned line_num = 0;
+  while(std::getline(catalog_file, line)){
+    line_num++;
+    size_t comment = line.find('#');
+    if(comment != std::string::npos){
+      line.erase(comment);
+    }
+    
+    std::stringstream line_ss(line);
+    Site site;
+    if(!(line_ss >> site.name)){
+      continue; //blank line
+    }
+    
+    line_ss >> site.type >> site.min_x >> site.min_y >> site.max_x >> site.max_y >> site.path;
+    if(line_ss.fail() || (site.type != "cloud" && site.type != "dem")){
+      ROS_INFO("TerrainCatalog %s line %u is malformed, skipping it", catalog_fn, line_num);
+      continue;
+    }
+    line_ss >> site.aux_path;
+    
+    if(site.type == "cloud" && site.aux_path.empty()){
+      ROS_INFO("TerrainCatalog site %s needs a directory for its processed clouds", site.name.c_str());
+      continue;
+    }
+    
+    site.map = NULL;
+    site.memory_usage = 0;
+    site.expected_usage = OctoTerrainMap::estimateMemoryUsage(site.max_x - site.min_x, site.max_y - site.min_y);
+    site.last_used = 0;
+    sites_.push_back(site);
+  }
+  
+  ROS_INFO("TerrainCatalog has %lu sites, memory budget %lu MB", sites_.size(), memory_budget_ / (1024*1024));
+  return !sites_.empty();
+}
+
+int TerrainCatalog::loadSite(Site &site){
+  ROS_INFO("TerrainCatalog loading site %s", site.name.c_str());
+  
+  if(site.type == "dem"){
+    site.map = new OctoTerrainMap();
+    if(!site.map->loadDem(site.path.c_str(), site.aux_path.empty() ? NULL : site.aux_path.c_str())){
+      delete site.map;
+      site.map = NULL;
+      return 0;
+    }
+  }
+  else{
+    site.map = new OctoTerrainMap(site.path.c_str(), site.aux_path.c_str());
+  }
+  
+  site.memory_usage = site.map->getMemoryUsage();
+  site.expected_usage = site.memory_usage;
+  ROS_INFO("TerrainCatalog site %s uses %lu KB", site.name.c_str(), site.memory_usage / 1024);
+  return 1;
+}
+
+//Drops least recently used maps until reserve more bytes fit in the budget. keep is
+//never dropped, even if it alone is over budget.
+void TerrainCatalog::evict(const Site *keep, size_t reserve){
+  while((getMemoryUsage() + reserve) > memory_budget_){
+    Site *oldest = NULL;
+    for(unsigned i = 0; i < sites_.size(); i++){
+      Site &site = sites_[i];
+      if(site.map && &site != keep && (!oldest || site.last_used < oldest->last_used)){
+        oldest = &site;
+      }
+    }
+    
+    if(!oldest){
+      return;
+    }
+    
+    ROS_INFO("TerrainCatalog evicting site %s", oldest->name.c_str());
+    delete oldest->map;
+    oldest->map = NULL;
+    oldest->memory_usage = 0;
+  }
+}
+
+const TerrainMap* TerrainCatalog::getMap(float start_x, float start_y, float goal_x, float goal_y){
+  Site *best = NULL;
+  float best_area = 0;
+  for(unsigned i = 0; i < sites_.size(); i++){
+    Site &site = sites_[i];
+    int has_start = (start_x >= site.min_x) && (start_x <= site.max_x) && (start_y >= site.min_y) && (start_y <= site.max_y);
+    int has_goal = (goal_x >= site.min_x) && (goal_x <= site.max_x) && (goal_y >= site.min_y) && (goal_y <= site.max_y);
+    if(!has_start || !has_goal){
+      continue;
+    }
+    
+    float area = (site.max_x - site.min_x)*(site.max_y - site.min_y);
+    if(!best || area < best_area){
+      best = &site;
+      best_area = area;
+    }
+  }
+  
+  if(!best){
+    ROS_INFO("TerrainCatalog has no site covering (%f %f) and (%f %f)", start_x, start_y, goal_x, goal_y);
+    return NULL;
+  }
+  
+  if(!best->map){
+    evict(best, best->expected_usage); //make room first so loading never goes over the budget
+    if(!loadSite(*best)){
+      return NULL;
+    }
+  }
+  
+  best->last_used = ++use_counter_;
+  evict(best, 0); //in case the estimate was low
+  return best->map;
+}
+
+size_t TerrainCatalog::getMemoryUsage() const{
+  size_t total = OctoTerrainMap::getSharedMemoryUsage();
+  for(unsigned i = 0; i < sites_.size(); i++){
+    total += sites_[i].memory_usage;
+  }
+  return total;
+}
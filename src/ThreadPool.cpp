@@ -0,0 +1,92 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+
+
+ThreadPool::ThreadPool(unsigned num_threads){
+  if(num_threads == 0){
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  job_ = nullptr;
+  job_size_ = 0;
+  next_index_ = 0;
+  generation_ = 0;
+  num_busy_ = 0;
+  should_exit_ = false;
+
+  //The caller is worker 0, so one less thread.
+  for(unsigned i = 1; i < num_threads; i++){
+    threads_.emplace_back([this, i]{ threadFunction(i); });
+  }
+}
+
+ThreadPool::~ThreadPool(){
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    should_exit_ = true;
+  }
+  work_cv_.notify_all();
+  for(unsigned i = 0; i < threads_.size(); i++){
+    threads_[i].join();
+  }
+}
+
+void ThreadPool::runJob(unsigned worker){
+  unsigned i;
+  while((i = next_index_++) < job_size_){
+    (*job_)(i, worker);
+  }
+}
+
+void ThreadPool::threadFunction(unsigned worker){
+  unsigned seen_generation = 0;
+  while(true){
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [this, seen_generation]{ return should_exit_ || (generation_ != seen_generation); });
+      if(should_exit_){
+        return;
+      }
+      seen_generation = generation_;
+    }
+
+    runJob(worker);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      num_busy_--;
+      if(num_busy_ == 0){
+        done_cv_.notify_one();
+      }
+    }
+  }
+}
+
+void ThreadPool::parallelFor(unsigned n, const std::function<void(unsigned, unsigned)> &fn){
+  std::lock_guard<std::mutex> call_lock(call_mutex_);
+
+  if(threads_.empty() || n <= 1){
+    for(unsigned i = 0; i < n; i++){
+      fn(i, 0);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    job_ = &fn;
+    job_size_ = n;
+    next_index_ = 0;
+    num_busy_ = threads_.size();
+    generation_++;
+  }
+  work_cv_.notify_all();
+
+  runJob(0);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this]{ return num_busy_ == 0; });
+  job_ = nullptr;
+}
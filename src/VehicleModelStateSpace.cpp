@@ -0,0 +1,276 @@
+#include "VehicleModelStateSpace.h"
+#include "VehicleStateSpace.h"
+
+#include "ompl/util/Exception.h"
+#include <ros/ros.h>
+
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <vector>
+
+
+
+void ompl::base::VehicleModelStateSampler::sampleUniform(State *state)
+{
+  const RealVectorBounds &bounds = static_cast<const VehicleModelStateSpace *>(space_)->getBounds();
+  
+  auto *mstate = static_cast<VehicleModelStateSpace::StateType *>(state);
+  for (unsigned int i = 0; i < VehicleModelStateSpace::DIM; ++i)
+    mstate->values[i] = rng_.uniformReal(bounds.low[i], bounds.high[i]);
+}
+
+void ompl::base::VehicleModelStateSampler::sampleUniformNear(State *state, const State *near, const double distance)
+{
+  const RealVectorBounds &bounds = static_cast<const VehicleModelStateSpace *>(space_)->getBounds();
+  
+  auto *mstate = static_cast<VehicleModelStateSpace::StateType *>(state);
+  const auto *mnear = static_cast<const VehicleModelStateSpace::StateType *>(near);
+  for (unsigned int i = 0; i < VehicleModelStateSpace::DIM; ++i)
+    mstate->values[i] = rng_.uniformReal(std::max(bounds.low[i], mnear->values[i] - distance),
+                                         std::min(bounds.high[i], mnear->values[i] + distance));
+}
+
+void ompl::base::VehicleModelStateSampler::sampleGaussian(State *state, const State *mean, const double stdDev)
+{
+  const RealVectorBounds &bounds = static_cast<const VehicleModelStateSpace *>(space_)->getBounds();
+  
+  auto *mstate = static_cast<VehicleModelStateSpace::StateType *>(state);
+  const auto *mmean = static_cast<const VehicleModelStateSpace::StateType *>(mean);
+  for (unsigned int i = 0; i < VehicleModelStateSpace::DIM; ++i)
+    {
+      double v = rng_.gaussian(mmean->values[i], stdDev);
+      mstate->values[i] = std::max(bounds.low[i], std::min(bounds.high[i], v));
+    }
+}
+
+
+
+ompl::base::VehicleModelStateSpace::VehicleModelStateSpace() : bounds_(DIM)
+{
+  type_ = STATE_SPACE_VEHICLE_MODEL;
+  setName("VehicleModel" + getName());
+}
+
+void ompl::base::VehicleModelStateSpace::setBounds(const RealVectorBounds &bounds)
+{
+  bounds.check();
+  if (bounds.low.size() != DIM)
+    throw Exception("VehicleModelStateSpace bounds need " + std::to_string(DIM) + " dimensions, got " + std::to_string(bounds.low.size()));
+  bounds_ = bounds;
+}
+
+void ompl::base::VehicleModelStateSpace::setup()
+{
+  bounds_.check();
+  StateSpace::setup();
+}
+
+void ompl::base::VehicleModelStateSpace::registerProjections()
+{
+  registerDefaultProjection(std::make_shared<VehicleModelProjectionEvaluator>(this));
+}
+
+bool ompl::base::VehicleModelStateSpace::isMetricSpace() const
+{
+  std::vector<float> weights;
+  ros::param::get("/distance_weights", weights);
+  return (weights[2] == 0) && (weights[3] == 0);
+}
+
+unsigned int ompl::base::VehicleModelStateSpace::getDimension() const
+{
+  return DIM;
+}
+
+//Only x and y count toward distance, same as VehicleStateSpace.
+double ompl::base::VehicleModelStateSpace::getMaximumExtent() const
+{
+  double e = 0.0;
+  for (unsigned int i = X; i <= Y; ++i)
+    {
+      double d = bounds_.high[i] - bounds_.low[i];
+      e += d * d;
+    }
+  return sqrt(e) + 100;
+}
+
+double ompl::base::VehicleModelStateSpace::getMeasure() const
+{
+  double m = 1.0;
+  for (unsigned int i = 0; i < DIM; ++i)
+    m *= bounds_.high[i] - bounds_.low[i];
+  return m;
+}
+
+void ompl::base::VehicleModelStateSpace::enforceBounds(State *state) const
+{
+  auto *mstate = static_cast<StateType *>(state);
+  for (unsigned int i = 0; i < DIM; ++i)
+    {
+      if (mstate->values[i] > bounds_.high[i])
+        mstate->values[i] = bounds_.high[i];
+      else if (mstate->values[i] < bounds_.low[i])
+        mstate->values[i] = bounds_.low[i];
+    }
+}
+
+bool ompl::base::VehicleModelStateSpace::satisfiesBounds(const State *state) const
+{
+  const auto *mstate = static_cast<const StateType *>(state);
+  for (unsigned int i = 0; i < DIM; ++i)
+    if (mstate->values[i] - std::numeric_limits<float>::epsilon() > bounds_.high[i] ||
+        mstate->values[i] + std::numeric_limits<float>::epsilon() < bounds_.low[i])
+      return false;
+  return true;
+}
+
+void ompl::base::VehicleModelStateSpace::copyState(State *destination, const State *source) const
+{
+  memcpy(static_cast<StateType *>(destination)->values, static_cast<const StateType *>(source)->values, sizeof(float)*DIM);
+}
+
+unsigned int ompl::base::VehicleModelStateSpace::getSerializationLength() const
+{
+  return sizeof(float)*DIM;
+}
+
+void ompl::base::VehicleModelStateSpace::serialize(void *serialization, const State *state) const
+{
+  memcpy(serialization, state->as<StateType>()->values, sizeof(float)*DIM);
+}
+
+void ompl::base::VehicleModelStateSpace::deserialize(State *state, const void *serialization) const
+{
+  memcpy(state->as<StateType>()->values, serialization, sizeof(float)*DIM);
+}
+
+//Same terms as VehicleStateSpace::distance, read from this layout.
+double ompl::base::VehicleModelStateSpace::distance(const State *state1, const State *state2) const
+{
+  const float *s1 = static_cast<const StateType *>(state1)->values;
+  const float *s2 = static_cast<const StateType *>(state2)->values;
+  
+  std::vector<float> weights;
+  ros::param::get("/distance_weights", weights);
+  double vec[2] = {s2[X] - s1[X], s2[Y] - s1[Y]};
+  double vec_magnitude = sqrt((vec[0]*vec[0]) + (vec[1]*vec[1]));
+  
+  double vel_magnitude = sqrt((s1[QX]*s1[QX]) + (s1[QY]*s1[QY]));
+  double velocity_dot = ((vec[0]*s1[QX]) + (vec[1]*s1[QY])) / (vel_magnitude*vec_magnitude);
+  double velocity_err = (vec_magnitude == 0)? 0: (1 - velocity_dot);
+  
+  double dist = (vec[0]*vec[0]*weights[0]) + (vec[1]*vec[1]*weights[1]);
+  return sqrt(dist) + fmin(100, weights[2]*velocity_err);
+}
+
+bool ompl::base::VehicleModelStateSpace::equalStates(const State *state1, const State *state2) const
+{
+  const float *s1 = static_cast<const StateType *>(state1)->values;
+  const float *s2 = static_cast<const StateType *>(state2)->values;
+  for (unsigned int i = 0; i < DIM; ++i)
+    if (fabsf(s1[i] - s2[i]) > std::numeric_limits<float>::epsilon() * 2.0f)
+      return false;
+  return true;
+}
+
+void ompl::base::VehicleModelStateSpace::interpolate(const State *from, const State *to, const double t, State *state) const
+{
+  const float *mfrom = static_cast<const StateType *>(from)->values;
+  const float *mto = static_cast<const StateType *>(to)->values;
+  float *mstate = static_cast<StateType *>(state)->values;
+  for (unsigned int i = 0; i < DIM; ++i)
+    mstate[i] = mfrom[i] + (mto[i] - mfrom[i]) * t;
+}
+
+ompl::base::StateSamplerPtr ompl::base::VehicleModelStateSpace::allocDefaultStateSampler() const
+{
+  return std::make_shared<VehicleModelStateSampler>(this);
+}
+
+ompl::base::State *ompl::base::VehicleModelStateSpace::allocState() const
+{
+  return new StateType();
+}
+
+void ompl::base::VehicleModelStateSpace::freeState(State *state) const
+{
+  delete static_cast<StateType *>(state);
+}
+
+void ompl::base::VehicleModelStateSpace::printState(const State *state, std::ostream &out) const
+{
+  out << "VehicleModelState [";
+  if (state != nullptr)
+    {
+      const auto *mstate = static_cast<const StateType *>(state);
+      for (unsigned int i = 0; i < DIM; ++i)
+        {
+          out << mstate->values[i];
+          if (i + 1 < DIM)
+            out << ' ';
+        }
+    }
+  else
+    out << "nullptr" << std::endl;
+  out << ']' << std::endl;
+}
+
+
+
+ompl::base::VehicleModelProjectionEvaluator::VehicleModelProjectionEvaluator(const StateSpace *space) : ProjectionEvaluator(space)
+{
+  cellSizes_.resize(2, 1.0);
+}
+
+unsigned int ompl::base::VehicleModelProjectionEvaluator::getDimension() const
+{
+  return 2;
+}
+
+void ompl::base::VehicleModelProjectionEvaluator::project(const State *state, Eigen::Ref<Eigen::VectorXd> projection) const
+{
+  const auto *mstate = state->as<VehicleModelStateSpace::StateType>();
+  projection(0) = mstate->getX();
+  projection(1) = mstate->getY();
+}
+
+
+
+void auvsl::getVehiclePose(const ompl::base::StateSpace *space, const ompl::base::State *state, double *pose){
+  if(isModelStateSpace(space)){
+    const float *values = state->as<ompl::base::VehicleModelStateSpace::StateType>()->values;
+    for(int i = 0; i < 3; i++){
+      pose[i] = values[ompl::base::VehicleModelStateSpace::X + i];
+    }
+    for(int i = 0; i < 4; i++){
+      pose[3+i] = values[ompl::base::VehicleModelStateSpace::QX + i];
+    }
+  }
+  else{
+    memcpy(pose, state->as<ompl::base::VehicleStateSpace::StateType>()->values, sizeof(double)*7);
+  }
+}
+
+void auvsl::initVehicleState(const ompl::base::StateSpace *space, ompl::base::State *state, const double *pose){
+  if(isModelStateSpace(space)){
+    float *values = state->as<ompl::base::VehicleModelStateSpace::StateType>()->values;
+    for(unsigned i = 0; i < ompl::base::VehicleModelStateSpace::DIM; i++){
+      values[i] = 0;
+    }
+    for(int i = 0; i < 3; i++){
+      values[ompl::base::VehicleModelStateSpace::X + i] = pose[i];
+    }
+    for(int i = 0; i < 4; i++){
+      values[ompl::base::VehicleModelStateSpace::QX + i] = pose[3+i];
+    }
+  }
+  else{
+    double *values = state->as<ompl::base::VehicleStateSpace::StateType>()->values;
+    for(unsigned i = 0; i < space->getDimension(); i++){
+      values[i] = 0;
+    }
+    memcpy(values, pose, sizeof(double)*7);
+  }
+}
@@ -36,12 +36,15 @@
   
 #include "VehicleRRT.h"
 #include "GlobalParams.h"
+#include "JackalStatePropagator.h"
+#include "VehicleModelStateSpace.h"
 
 #include "ompl/base/goals/GoalSampleableRegion.h"
 #include "ompl/tools/config/SelfConfig.h"
 #include <ompl/base/spaces/RealVectorStateSpace.h>
 #include <ompl/control/spaces/RealVectorControlSpace.h>
 #include <limits>
+#include <algorithm>
 #include <ros/ros.h>
 #include <eigen3/Eigen/Dense>
 #include <unistd.h>
@@ -102,14 +105,33 @@ void ompl::control::VehicleRRT::freeMemory()
     }
 }
 
-unsigned ompl::control::VehicleRRT::controlWhileValid(const ompl::base::State *state, ompl::base::State *goal, unsigned steps, std::vector<base::State*> &result){
+unsigned ompl::control::VehicleRRT::controlWhileValid(const ompl::base::State *state, ompl::base::State *goal, unsigned steps, std::vector<base::State*> &result, std::vector<Control*> *controls){
   double signedStepSize = siC_->getPropagationStepSize();
   
   //ROS_INFO("Propagation step size %f", signedStepSize);
   
   const ompl::control::StatePropagatorPtr &statePropagator = siC_->getStatePropagator();
+  const ompl::base::StateSpace *space = si_->getStateSpace().get();
+  
+  //The dynamics can bail out partway through a step that rolls over or leaves the map.
+  const JackalStatePropagator *jackal_propagator = dynamic_cast<const JackalStatePropagator*>(statePropagator.get());
+  auto propagateValid = [&](const base::State *from, const Control *control, base::State *to){
+    if(jackal_propagator){
+      double valid_duration;
+      if(!jackal_propagator->propagateUntilInvalid(from, control, signedStepSize, to, valid_duration)){
+        return false;
+      }
+    }
+    else{
+      statePropagator->propagate(from, control, signedStepSize, to);
+    }
+    return si_->isValid(to);
+  };
   
   result.resize(steps);
+  if(controls){
+    controls->clear();
+  }
   
   int st = 0;
   float Vf, Wz, dx, dy;
@@ -119,11 +141,13 @@ unsigned ompl::control::VehicleRRT::controlWhileValid(const ompl::base::State *s
   std::vector<Eigen::Vector2f> waypoints;
   geometry_msgs::Pose pose;
   
-  double *result_values;
+  double result_values[7];
   ompl::control::Control *control = siC_->allocControl();
   
-  const double *start_values = state->as<ompl::base::RealVectorStateSpace::StateType>()->values;
-  const double *goal_values = goal->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+  double start_values[7];
+  double goal_values[7];
+  auvsl::getVehiclePose(space, state, start_values);
+  auvsl::getVehiclePose(space, goal, goal_values);
   
   if(st < steps){
     result[st] = si_->allocState();
@@ -146,11 +170,12 @@ unsigned ompl::control::VehicleRRT::controlWhileValid(const ompl::base::State *s
     double *control_vector = control->as<ompl::control::RealVectorControlSpace::ControlType>()->values;
     control_vector[0] = Wz;
     control_vector[1] = Vf;
-    statePropagator->propagate(state, control, signedStepSize, result[st]);
-    
-    
-    if (si_->isValid(result[st])) {
-      result_values = result[st]->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+    if (propagateValid(state, control, result[st])) {
+      if(controls){
+        controls->push_back(siC_->cloneControl(control));
+      }
+      
+      auvsl::getVehiclePose(space, result[st], result_values);
       
       dx = result_values[0] - goal_values[0];
       dy = result_values[1] - goal_values[1];
@@ -163,7 +188,7 @@ unsigned ompl::control::VehicleRRT::controlWhileValid(const ompl::base::State *s
       while (st < steps) {
         result[st] = si_->allocState();
         
-        result_values = result[st - 1]->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+        auvsl::getVehiclePose(space, result[st - 1], result_values);
         
         pose.position.x = result_values[0];
         pose.position.y = result_values[1];
@@ -190,15 +215,17 @@ unsigned ompl::control::VehicleRRT::controlWhileValid(const ompl::base::State *s
         control_vector[0] = Wz;
         control_vector[1] = Vf;
         
-        statePropagator->propagate(result[st - 1], control, signedStepSize, result[st]);
-
-        if(!si_->isValid(result[st])){
+        if(!propagateValid(result[st - 1], control, result[st])){
           si_->freeState(result[st]);
           result.resize(st);
           break;
         }
         
-        result_values = result[st]->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+        if(controls){
+          controls->push_back(siC_->cloneControl(control));
+        }
+        
+        auvsl::getVehiclePose(space, result[st], result_values);
         //ROS_INFO("result values idx: %d   pos: %f %f", st, result_values[0], result_values[1]);
         
         dx = result_values[0] - goal_values[0];
@@ -220,7 +247,7 @@ unsigned ompl::control::VehicleRRT::controlWhileValid(const ompl::base::State *s
       st = best_idx+1;
       result.resize(st);
       */
-      result_values = result[st-1]->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+      auvsl::getVehiclePose(space, result[st-1], result_values);
 
       //ROS_INFO("Orientation %f %f %f %f", start_values[3], start_values[4], start_values[5], start_values[6]);
       // ROS_INFO("Start: <%f %f>", start_values[0], start_values[1]);
@@ -242,6 +269,127 @@ unsigned ompl::control::VehicleRRT::controlWhileValid(const ompl::base::State *s
   return st;
 }
 
+//Drives along a path that was planned with a cheaper model, chasing the next path state
+//like the real controller would. Stops when a state is invalid or the vehicle strays more
+//than tolerance from the segment it is on. Caller owns the states in tracked.
+unsigned ompl::control::VehicleRRT::trackPath(const std::vector<base::State*> &path, unsigned first_target, const StatePropagatorPtr &propagator, double tolerance, std::vector<base::State*> &tracked){
+  double signedStepSize = siC_->getPropagationStepSize();
+  const ompl::base::StateSpace *space = si_->getStateSpace().get();
+  
+  if(path.empty()){
+    return 0;
+  }
+  first_target = std::max(first_target, 1u);
+  if(first_target >= path.size()){
+    return path.size();
+  }
+  
+  if(tracked.empty()){
+    base::State *first = si_->allocState();
+    si_->copyState(first, path[0]);
+    tracked.push_back(first);
+  }
+  base::State *current = tracked.back();
+  
+  //Give up once the rest of the path would have been covered at the slowest speed worth tracking.
+  double length = 0;
+  for(unsigned i = first_target; i < path.size(); i++){
+    double a[7];
+    double b[7];
+    auvsl::getVehiclePose(space, path[i-1], a);
+    auvsl::getVehiclePose(space, path[i], b);
+    length += sqrt(((b[0]-a[0])*(b[0]-a[0])) + ((b[1]-a[1])*(b[1]-a[1])));
+  }
+  unsigned max_steps = (unsigned) ceil(length / (std::max(GlobalParams::get_track_min_speed(), .01f)*signedStepSize)) + 20;
+  
+  std::vector<Eigen::Vector2f> waypoints(3);
+  geometry_msgs::Pose pose;
+  float Vf, Wz;
+  ompl::control::Control *control = siC_->allocControl();
+  double *control_vector = control->as<ompl::control::RealVectorControlSpace::ControlType>()->values;
+  
+  unsigned target = first_target;
+  for(unsigned step = 0; target < path.size() && step < max_steps; step++){
+    double cur_values[7];
+    auvsl::getVehiclePose(space, current, cur_values);
+    
+    //skip path states that have already been reached
+    while(target < path.size()-1){
+      double target_values[7];
+      auvsl::getVehiclePose(space, path[target], target_values);
+      float dx = cur_values[0] - target_values[0];
+      float dy = cur_values[1] - target_values[1];
+      if(sqrtf((dx*dx) + (dy*dy)) >= tolerance){
+        break;
+      }
+      target++;
+    }
+    
+    double target_values[7];
+    double next_values[7];
+    auvsl::getVehiclePose(space, path[target], target_values);
+    auvsl::getVehiclePose(space, path[std::min<size_t>(target+1, path.size()-1)], next_values);
+    waypoints[0] = Eigen::Vector2f(cur_values[0], cur_values[1]);
+    waypoints[1] = Eigen::Vector2f(target_values[0], target_values[1]);
+    waypoints[2] = Eigen::Vector2f(next_values[0], next_values[1]);
+    
+    pose.position.x = cur_values[0];
+    pose.position.y = cur_values[1];
+    pose.position.z = cur_values[2];
+    
+    pose.orientation.x = cur_values[3];
+    pose.orientation.y = cur_values[4];
+    pose.orientation.z = cur_values[5];
+    pose.orientation.w = cur_values[6];
+    
+    control_system_->computeVelocityCommand(waypoints, pose, Vf, Wz);
+    control_vector[0] = Wz;
+    control_vector[1] = Vf;
+    
+    base::State *next = si_->allocState();
+    propagator->propagate(current, control, signedStepSize, next);
+    
+    if(!si_->isValid(next)){
+      si_->freeState(next);
+      break;
+    }
+    
+    //cross track error against the segment between the previous and target path states
+    double prev_values[7];
+    auvsl::getVehiclePose(space, path[target-1], prev_values);
+    double new_values[7];
+    auvsl::getVehiclePose(space, next, new_values);
+    float seg_x = target_values[0] - prev_values[0];
+    float seg_y = target_values[1] - prev_values[1];
+    float seg_len2 = (seg_x*seg_x) + (seg_y*seg_y);
+    float t = 0;
+    if(seg_len2 > 1e-9f){
+      t = (((new_values[0] - prev_values[0])*seg_x) + ((new_values[1] - prev_values[1])*seg_y)) / seg_len2;
+      t = std::max(0.0f, std::min(1.0f, t));
+    }
+    float ex = new_values[0] - (prev_values[0] + t*seg_x);
+    float ey = new_values[1] - (prev_values[1] + t*seg_y);
+    if(sqrtf((ex*ex) + (ey*ey)) > tolerance){
+      si_->freeState(next);
+      break;
+    }
+    
+    tracked.push_back(next);
+    current = next;
+    
+    if(target == path.size()-1){
+      float dx = new_values[0] - target_values[0];
+      float dy = new_values[1] - target_values[1];
+      if(sqrtf((dx*dx) + (dy*dy)) < tolerance){
+        target = path.size();
+      }
+    }
+  }
+  
+  siC_->freeControl(control);
+  return target;
+}
+
 ompl::base::PlannerStatus ompl::control::VehicleRRT::solve(const base::PlannerTerminationCondition &ptc) {
   checkValidity();
   base::Goal *goal = pdef_->getGoal().get();
@@ -310,20 +458,39 @@ ompl::base::PlannerStatus ompl::control::VehicleRRT::solve(const base::PlannerTe
       unsigned cd = ceilf(10.0f / siC_->getPropagationStepSize());
       
       std::vector<base::State*> pstates;
-      //=//cd = siC_->propagateWhileValid(nmotion->state, rctrl, cd, pstates, true);
-      cd = controlWhileValid(nmotion->state, rmotion->state, cd, pstates);
+      std::vector<Control*> pcontrols;
+      //The fused rollout only knows the simple controller. It leaves the trajectory in rollout_
+      //and states are only made below for the steps the tree keeps.
+      const JackalStatePropagator *jackal_propagator = dynamic_cast<const JackalStatePropagator*>(siC_->getStatePropagator().get());
+      bool use_rollout = jackal_propagator && jackal_propagator->canRollout() && dynamic_cast<auvsl::SimpleControlSystem*>(control_system_);
+      if(use_rollout){
+        double goal_pose[7];
+        auvsl::getVehiclePose(si_->getStateSpace().get(), rmotion->state, goal_pose);
+        cd = jackal_propagator->rollout(nmotion->state, goal_pose[0], goal_pose[1], cd, siC_->getPropagationStepSize(), rollout_);
+      }
+      else{
+        //=//cd = siC_->propagateWhileValid(nmotion->state, rctrl, cd, pstates, true);
+        cd = controlWhileValid(nmotion->state, rmotion->state, cd, pstates, &pcontrols);
+      }
         
       if (cd >= siC_->getMinControlDuration()){
         Motion *lastmotion = nmotion;
         bool solved = false;
         size_t p = 0;
-        for (; p < pstates.size(); ++p){
+        for (; p < cd; ++p){
           /* create a motion */
           auto *motion = new Motion();
-          motion->state = pstates[p];
-          // we need multiple copies of rctrl
-          motion->control = siC_->allocControl();
-          siC_->copyControl(motion->control, rctrl);
+          if(use_rollout){
+            motion->state = si_->allocState();
+            motion->control = siC_->allocControl();
+            jackal_propagator->getRolloutStep(rollout_, p, motion->state, motion->control);
+          }
+          else{
+            motion->state = pstates[p];
+            //The control system's command for this step. With it the path replays exactly and
+            //the states already are the trajectory, nothing has to be simulated again after solve.
+            motion->control = pcontrols[p];
+          }
           motion->steps = 1;
           motion->parent = lastmotion;
           lastmotion = motion;
@@ -344,6 +511,7 @@ ompl::base::PlannerStatus ompl::control::VehicleRRT::solve(const base::PlannerTe
         // free any states after we hit the goal
         while (++p < pstates.size()){
           si_->freeState(pstates[p]);
+          siC_->freeControl(pcontrols[p]);
         }
         if (solved)
           break;
@@ -353,6 +521,9 @@ ompl::base::PlannerStatus ompl::control::VehicleRRT::solve(const base::PlannerTe
         for (auto &pstate : pstates){
           si_->freeState(pstate);
         }
+        for (auto &pcontrol : pcontrols){
+          siC_->freeControl(pcontrol);
+        }
       }
     
     }
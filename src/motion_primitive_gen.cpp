@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include "GlobalParams.h"
+#include "JackalStatePropagator.h"
+#include "MotionPrimitiveLibrary.h"
+#include "VehicleStateSpace.h"
+
+#include <ompl/control/SpaceInformation.h>
+#include <ompl/control/spaces/RealVectorControlSpace.h>
+
+#include <ros/ros.h>
+
+#include <string>
+#include <vector>
+
+
+/*
+ * Sweeps JackalStatePropagator over a grid of commands and initial speeds on
+ * flat ground and writes the results as a MotionPrimitiveLibrary table.
+ * HybridDynamics decides the soil itself, so soil_index only labels the table.
+ * Run it once per soil the solver is configured for.
+ */
+
+static bool alwaysValid(const ompl::base::State *state){
+  return true;
+}
+
+static double yawOf(const double *val){
+  return atan2(2*((val[6]*val[5]) + (val[3]*val[4])), 1 - 2*((val[4]*val[4]) + (val[5]*val[5])));
+}
+
+static float axisValue(float min, float max, unsigned num, unsigned i){
+  return min + ((max - min)*i / (num - 1));
+}
+
+int main(int argc, char **argv){
+  ros::init(argc, argv, "motion_primitive_gen");
+  ros::NodeHandle nh;
+  GlobalParams::load_params(&nh);
+  
+  std::string table_fn = "motion_primitives.bin";
+  int soil_index = 0;
+  int num_wz = 11;
+  int num_vf = 9;
+  int num_v0 = 9;
+  int num_w0 = 7;
+  float wz_max = GlobalParams::get_max_angular_vel();
+  float vf_max = GlobalParams::get_fuzzy_constant_speed();
+  float w0_max = GlobalParams::get_max_angular_vel();
+  float start_z = .2;
+  float settle_time = 2;
+  nh.getParam("/MotionPrimitives/output_filename", table_fn);
+  nh.getParam("/MotionPrimitives/soil_index", soil_index);
+  nh.getParam("/MotionPrimitives/num_wz", num_wz);
+  nh.getParam("/MotionPrimitives/num_vf", num_vf);
+  nh.getParam("/MotionPrimitives/num_v0", num_v0);
+  nh.getParam("/MotionPrimitives/num_w0", num_w0);
+  nh.getParam("/MotionPrimitives/wz_max", wz_max);
+  nh.getParam("/MotionPrimitives/vf_max", vf_max);
+  nh.getParam("/MotionPrimitives/w0_max", w0_max);
+  nh.getParam("/MotionPrimitives/start_z", start_z);
+  nh.getParam("/MotionPrimitives/settle_time", settle_time);
+  
+  if(num_wz < 2 || num_vf < 2 || num_v0 < 2 || num_w0 < 2){
+    ROS_INFO("motion_primitive_gen needs at least 2 samples per axis");
+    return 1;
+  }
+  
+  HybridDynamics::setAltitudeMap([](float x, float y, float z_guess){ return 0.0f; });
+  
+  ompl::base::VehicleStateSpace *space = new ompl::base::VehicleStateSpace(17);
+  ompl::base::RealVectorBounds bounds(17);
+  bounds.setLow(-2000);
+  bounds.setHigh(2000);
+  space->setBounds(bounds);
+  ompl::base::StateSpacePtr space_ptr(space);
+  
+  ompl::control::RealVectorControlSpace *cspace = new ompl::control::RealVectorControlSpace(space_ptr, 2);
+  ompl::base::RealVectorBounds cbounds(2);
+  cbounds.setLow(0, -wz_max); cbounds.setHigh(0, wz_max);
+  cbounds.setLow(1, 0);       cbounds.setHigh(1, vf_max);
+  cspace->setBounds(cbounds);
+  ompl::control::ControlSpacePtr cspace_ptr(cspace);
+  
+  ompl::control::SpaceInformationPtr si(new ompl::control::SpaceInformation(space_ptr, cspace_ptr));
+  si->setStateValidityChecker(alwaysValid);
+  si->setPropagationStepSize(GlobalParams::get_propagation_step_size());
+  si->setup();
+  
+  JackalStatePropagator propagator(si);
+  double duration = si->getPropagationStepSize();
+  
+  //Let the vehicle settle onto the ground so every primitive starts at rest height and attitude.
+  ompl::base::State *rest_state = si->allocState();
+  ompl::control::Control *zero_control = si->allocControl();
+  double *rest_val = rest_state->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+  for(int i = 0; i < 17; i++){
+    rest_val[i] = 0;
+  }
+  rest_val[2] = start_z;
+  rest_val[6] = 1;
+  double *zero_vector = zero_control->as<ompl::control::RealVectorControlSpace::ControlType>()->values;
+  zero_vector[0] = 0;
+  zero_vector[1] = 0;
+  propagator.propagate(rest_state, zero_control, settle_time, rest_state);
+  ROS_INFO("Settled at z %f", rest_val[2]);
+  
+  PrimitiveTableHeader header;
+  header.magic = PRIMITIVE_MAGIC;
+  header.version = PRIMITIVE_VERSION;
+  header.soil_index = soil_index;
+  header.duration = duration;
+  header.num_wz = num_wz;
+  header.num_vf = num_vf;
+  header.num_v0 = num_v0;
+  header.num_w0 = num_w0;
+  header.wz_min = -wz_max; header.wz_max = wz_max;
+  header.vf_min = 0;       header.vf_max = vf_max;
+  header.v0_min = 0;       header.v0_max = vf_max;
+  header.w0_min = -w0_max; header.w0_max = w0_max;
+  
+  unsigned num_entries = num_wz*num_vf*num_v0*num_w0;
+  std::vector<const ompl::base::State*> starts(num_entries);
+  std::vector<const ompl::control::Control*> controls(num_entries);
+  std::vector<double> durations(num_entries, duration);
+  std::vector<ompl::base::State*> results(num_entries);
+  std::vector<unsigned> steps;
+  std::vector<int> valid;
+  
+  float base_width = 2*Jackal::rcg::tx_front_left_wheel;
+  for(unsigned entry = 0; entry < num_entries; entry++){
+    unsigned i_wz = entry % num_wz;
+    unsigned i_vf = (entry / num_wz) % num_vf;
+    unsigned i_v0 = (entry / (num_wz*num_vf)) % num_v0;
+    unsigned i_w0 = entry / (num_wz*num_vf*num_v0);
+    
+    ompl::base::State *start = si->allocState();
+    si->copyState(start, rest_state);
+    double *start_val = start->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+    float v0 = axisValue(header.v0_min, header.v0_max, num_v0, i_v0);
+    float w0 = axisValue(header.w0_min, header.w0_max, num_w0, i_w0);
+    start_val[7] = v0; //rest heading is ~0 so world and heading frames agree
+    start_val[8] = 0;
+    start_val[12] = w0;
+    
+    //wheels rolling without slip at that speed. qd order is front left, front right, back left, back right.
+    float vl = (v0 - w0*(base_width/2.0))/Jackal::rcg::tire_radius;
+    float vr = (v0 + w0*(base_width/2.0))/Jackal::rcg::tire_radius;
+    start_val[13] = vl;
+    start_val[14] = vr;
+    start_val[15] = vl;
+    start_val[16] = vr;
+    starts[entry] = start;
+    
+    ompl::control::Control *control = si->allocControl();
+    double *control_vector = control->as<ompl::control::RealVectorControlSpace::ControlType>()->values;
+    control_vector[0] = axisValue(header.wz_min, header.wz_max, num_wz, i_wz);
+    control_vector[1] = axisValue(header.vf_min, header.vf_max, num_vf, i_vf);
+    controls[entry] = control;
+    
+    results[entry] = si->allocState();
+  }
+  
+  ROS_INFO("Sweeping %u primitives", num_entries);
+  propagator.propagateBatch(starts, controls, durations, results, steps, valid);
+  
+  float *entries = new float[num_entries*PRIMITIVE_LEN];
+  for(unsigned entry = 0; entry < num_entries; entry++){
+    const double *start_val = starts[entry]->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+    const double *end_val = results[entry]->as<ompl::base::RealVectorStateSpace::StateType>()->values;
+    
+    double yaw = yawOf(start_val);
+    double c = cos(yaw);
+    double s = sin(yaw);
+    double dx = end_val[0] - start_val[0];
+    double dy = end_val[1] - start_val[1];
+    double dyaw = yawOf(end_val) - yaw;
+    dyaw = atan2(sin(dyaw), cos(dyaw));
+    
+    float *prim = &entries[entry*PRIMITIVE_LEN];
+    prim[PRIM_DX] = (c*dx) + (s*dy);
+    prim[PRIM_DY] = (-s*dx) + (c*dy);
+    prim[PRIM_DYAW] = dyaw;
+    prim[PRIM_VX] = (c*end_val[7]) + (s*end_val[8]);
+    prim[PRIM_VY] = (-s*end_val[7]) + (c*end_val[8]);
+    prim[PRIM_VZ] = end_val[9];
+    prim[PRIM_WX] = (c*end_val[10]) + (s*end_val[11]);
+    prim[PRIM_WY] = (-s*end_val[10]) + (c*end_val[11]);
+    prim[PRIM_WZ] = end_val[12];
+    prim[PRIM_QD1] = end_val[13];
+    prim[PRIM_QD2] = end_val[14];
+    prim[PRIM_QD3] = end_val[15];
+    prim[PRIM_QD4] = end_val[16];
+    
+    si->freeState((ompl::base::State*) starts[entry]);
+    si->freeControl((ompl::control::Control*) controls[entry]);
+    si->freeState(results[entry]);
+  }
+  
+  int ok = MotionPrimitiveLibrary::write(table_fn.c_str(), header, entries);
+  if(ok){
+    ROS_INFO("Wrote %u primitives for soil %d to %s", num_entries, soil_index, table_fn.c_str());
+  }
+  
+  delete[] entries;
+  si->freeState(rest_state);
+  si->freeControl(zero_control);
+  return ok ? 0 : 1;
+}
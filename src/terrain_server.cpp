@@ -0,0 +1,58 @@
+#include <stdlib.h>
+
+#include "GlobalParams.h"
+#include "OctoTerrainMap.h"
+#include "SharedTerrainMap.h"
+
+#include <ros/ros.h>
+
+#include <string>
+
+
+/*
+ * Builds the terrain map once and publishes it to shared memory so the
+ * planner and test nodes can attach to it instead of building their own.
+ * The segment is removed when this node shuts down.
+ */
+
+int main(int argc, char **argv){
+  ros::init(argc, argv, "terrain_server");
+  ros::NodeHandle nh;
+  
+  GlobalParams::load_params(&nh);
+  
+  std::string shm_name = "/auvsl_terrain_map";
+  nh.getParam("/TerrainServer/shm_name", shm_name);
+  
+  std::string site_cloud_fn;
+  std::string dem_fn;
+  std::string dem_occ_fn;
+  nh.getParam("/TerrainMap/site_cloud_filename", site_cloud_fn);
+  nh.getParam("/TerrainMap/dem_filename", dem_fn);
+  nh.getParam("/TerrainMap/dem_occupancy_filename", dem_occ_fn);
+  
+  OctoTerrainMap *terrain_map;
+  if(!dem_fn.empty()){
+    terrain_map = new OctoTerrainMap();
+    if(!terrain_map->loadDem(dem_fn.c_str(), dem_occ_fn.c_str())){
+      ROS_INFO("Failed to load DEM %s", dem_fn.c_str());
+      return 1;
+    }
+  }
+  else{
+    terrain_map = new OctoTerrainMap(site_cloud_fn.c_str());
+  }
+  
+  if(!SharedTerrainMap::publish(terrain_map, shm_name.c_str())){
+    return 1;
+  }
+  
+  //Grids are copied into the segment, this copy isn't needed anymore.
+  delete terrain_map;
+  
+  ros::spin();
+  
+  SharedTerrainMap::unpublish(shm_name.c_str());
+  ROS_INFO("terrain_server is exiting");
+  return 0;
+}
@@ -165,8 +165,21 @@ int main(int argc, char **argv){
   
   ROS_INFO("Getting OctoTerrainMap");
   std::string site_cloud_fn;
+  std::string dem_fn;
+  std::string dem_occ_fn;
   nh.getParam("/TerrainMap/site_cloud_filename", site_cloud_fn);
-  terrain_map = new OctoTerrainMap(site_cloud_fn.c_str());
+  nh.getParam("/TerrainMap/dem_filename", dem_fn);
+  nh.getParam("/TerrainMap/dem_occupancy_filename", dem_occ_fn);
+  if(!dem_fn.empty()){
+    terrain_map = new OctoTerrainMap();
+    if(!terrain_map->loadDem(dem_fn.c_str(), dem_occ_fn.c_str())){
+      ROS_INFO("Failed to load DEM %s", dem_fn.c_str());
+      return 1;
+    }
+  }
+  else{
+    terrain_map = new OctoTerrainMap(site_cloud_fn.c_str());
+  }
   //SimpleTerrainMap simple_terrain_map;
   ROS_INFO("Constructed terrain map");
   